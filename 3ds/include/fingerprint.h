@@ -0,0 +1,32 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum fingerprint_mode{
+	FINGERPRINT_CRC32,                  // Legacy CRC32, the tile_hash of 0_1_0 profiles
+	FINGERPRINT_FP64                    // Faster 64 bit fingerprint for newer profiles
+} fingerprint_mode;
+
+typedef struct fingerprint_impl{
+	const char *name;
+	uint32_t (*crc32)(const uint8_t *data, size_t len);
+} fingerprint_impl_t;
+
+// CRC32 implementations, all of them produce the same values
+uint32_t crc32_bytewise(const uint8_t *data, size_t len);
+uint32_t crc32_slice8(const uint8_t *data, size_t len);
+#if defined(__x86_64__) || defined(__i386__)
+uint32_t crc32_pclmul(const uint8_t *data, size_t len);
+#endif
+
+extern uint32_t (*fingerprint_crc32)(const uint8_t *data, size_t len);
+extern const fingerprint_impl_t *fingerprint_crc32_impl;
+
+void fingerprint_init(void);
+int fingerprint_impls(const fingerprint_impl_t **impls);
+uint64_t fingerprint_fp64(const uint8_t *data, size_t len);
+uint64_t fingerprint(fingerprint_mode mode, const uint8_t *data, size_t len);
+
+#endif
@@ -1,7 +1,64 @@
 #ifndef  LCD_H
 #define  LCD_H
+#include <stdint.h>
+#include <stdbool.h>
 #include "peanut_gb.h"
 
+// Tagged pixels, written by the first pass of the line renderer
+#define TAG_COLOR           0x0003      // Color index
+#define TAG_PALETTE         0x0004      // Sprite uses OBP1
+#define TAG_PRIORITY        0x0008      // Sprite goes behind the background
+#define TAG_LAYER           0x0030      // Source layer, 0 if nothing was drawn
+#define TAG_LAYER_BG        0x0010
+#define TAG_LAYER_WIN       0x0020
+#define TAG_LAYER_OBJ       0x0030
+#define TAG_TILE_SHIFT      6           // VRAM tile slot in the upper bits
+#define TAG_TILE(tag)       ((tag) >> TAG_TILE_SHIFT)
+
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+#define SCANLINE_MAX_OBJ    MAX_SPRITES_LINE
+#else
+#define SCANLINE_MAX_OBJ    NUM_SPRITES
+#endif
+
+#define SCANLINE_TILES      (LCD_WIDTH/8 + 1) // Tiles a line partly scrolled covers
+
+typedef uint16_t tagged_pixel_t;
+
+typedef struct scanline_obj{
+    int16_t x;                          // Display x of the sprite's first column
+    uint8_t start, end;                 // Visible columns of the sprite
+    uint32_t tile_hash;                 // Tile data hash
+    uint32_t meta;                      // Meta entry plus one, 0 if the tile has none
+    tagged_pixel_t px[8];
+} scanline_obj_t;
+
+typedef struct scanline{
+    uint8_t bg_palette[4];              // Palettes at the time the line was drawn
+    uint8_t sp_palette[8];
+    uint8_t bg_offset;                  // Columns of the first tile scrolled out
+    int16_t win_x;                      // Display x of the window, LCD_WIDTH if hidden
+    tagged_pixel_t bg[LCD_WIDTH];
+    tagged_pixel_t win[LCD_WIDTH];
+    uint32_t bg_tiles[SCANLINE_TILES];  // Tile data hash of each tile, left to right,
+    uint32_t win_tiles[SCANLINE_TILES]; // resolved while decoding so painting never
+                                        // reads the emulator
+    uint32_t bg_metas[SCANLINE_TILES];  // Meta entry of each tile plus one, valid while
+    uint32_t win_metas[SCANLINE_TILES]; // the meta store is at meta_generation
+    uint32_t meta_generation;
+    uint8_t obj_count;                  // Sprites, from low to high priority
+    scanline_obj_t obj[SCANLINE_MAX_OBJ];
+} scanline_t;
+
+struct app_state;
+
+void lcd_init(void);
 void lcd_render_line(gb_s *gb);
+void lcd_decode_line(gb_s *gb, scanline_t *line);
+void lcd_paint_line(struct app_state *app, const scanline_t *line, int y);
+const scanline_t *lcd_get_scanline(int y);
+void lcd_set_incremental(bool enabled, bool verify_lines);
+uint32_t lcd_verify_failures(void);
+void lcd_finish_frame(struct app_state *app);
 
-#endif
\ No newline at end of file
+#endif
@@ -8,6 +8,7 @@
 #include "peanut_gb.h"
 #include "meta.h"
 #include "utils.h"
+#include "fingerprint.h"
 
 #define ENABLE_SOUND 0
 #define ENABLE_LCD 1
@@ -16,7 +17,8 @@
 #define TILE_SIZE 16
 
 #define VRAM_INSPECTOR_WIDTH 10
-#define Z_LAYERS 15
+#define Z_LAYERS 15                       // Depths a profile can use
+#define FRAMEBUFFER_BACKUPS 3
 #define BG_COLOR CLITERAL(Color){ 230, 224, 210, 255 }
 
 typedef enum{
@@ -28,12 +30,16 @@ typedef enum{
 typedef struct tile{
 	uint8_t *raw_data;
 	uint32_t hash;
+	meta_t *meta;                         // Resolved meta, NULL if the tile has none
+	uint32_t meta_generation;             // Meta store generation it was resolved at
+	bool meta_valid;                      // Cleared when the tile data changes
 } tile_t;
 
 typedef struct framebuffer{
     C3D_Tex *tex;
 	bool used_flag;
 	struct framebuffer *copy;
+	uint32_t painted_rows[FRAMEBUFFER_BACKUPS]; // 8-line tile rows painted on each backup
 } framebuffer_t;
 
 // rom, cart_ram y fb pertenecen a una pseudo estructura "priv" que gb espera
@@ -43,11 +49,10 @@ typedef struct app_state{
 	uint8_t *cart_ram;                    // Pointer to allocated memory holding save file.
 	framebuffer_t framebuffers[Z_LAYERS]; // Frame buffers
 	bool paused;
-	meta_t *meta;                         // Tiles metadata linked list
+	meta_store_t meta;                    // Tiles metadata store
 	gb_s gb;                              // Emulator context
 } app_state;
 
-extern const float intensity_levels[];
 extern tile_t tiles_on_vram[VRAM_TILE_COUNT];
 extern int selected_tile;
 extern uint32_t swizzle_table[256*256];
@@ -57,19 +62,86 @@ static inline C3D_Tex *get_framebuffer_tex(framebuffer_t *fb, int backup){
 	return fb->tex+(Z_LAYERS*backup);
 }
 
-static inline void draw_to_framebuffer(app_state *app, uint32_t z, int x, int y, Color color){
-	// Copy color to the framebuffer
-	framebuffer_t *fb = &app->framebuffers[z];
-	fb->used_flag = true;
-	color = (Color){color.a, color.b, color.g, color.r};
-	
+static inline uint32_t get_tile_hash(gb_s *gb, uint16_t tile_i){
+	// Re-hash the tile only if it was written since the last time
+	uint32_t *dirty = &gb->display.tiles_dirty[tile_i >> 5];
+	uint32_t bit = (uint32_t)1 << (tile_i & 31);
+	tile_t *t = &tiles_on_vram[tile_i];
+
+	if (*dirty & bit){
+		*dirty &= ~bit;
+		t->raw_data = &gb->vram[TILE_SIZE*tile_i];
+		t->hash = fingerprint_crc32(t->raw_data, TILE_SIZE);
+		t->meta_valid = false;
+	}
+
+	return t->hash;
+}
+
+static inline meta_t *get_tile_meta(app_state *app, uint16_t tile_i){
+	// Only resolve again if the tile data or the meta store changed
+	uint32_t hash = get_tile_hash(&app->gb, tile_i);
+	tile_t *t = &tiles_on_vram[tile_i];
+	if (t->meta_valid && t->meta_generation == app->meta.generation)
+		return t->meta;
+
+	t->meta = get_meta(&app->meta, hash);
+	t->meta_generation = app->meta.generation;
+	t->meta_valid = true;
+	return t->meta;
+}
+
+static inline uint32_t *get_framebuffer_line(framebuffer_t *fb, int y, const uint32_t **swizzle){
+	// Texture data and swizzle offsets of a display line, the LCD
+	// is centered in the 256x256 texture
 	int x_offset = 48;
 	int y_offset = 56;
-	
+
 	C3D_Tex *tex = get_framebuffer_tex(fb, backup);
-	((uint32_t*) tex->data)[swizzle_table[(y+y_offset)*256 + x + x_offset]] = *(uint32_t*)&color;
+	fb->painted_rows[backup] |= (uint32_t)1 << ((y+y_offset) >> 3);
+	*swizzle = &swizzle_table[(y+y_offset)*256 + x_offset];
+	return (uint32_t*) tex->data;
+}
+
+static inline uint32_t get_framebuffer_color(Color color){
+	// The texture stores ABGR
+	color = (Color){color.a, color.b, color.g, color.r};
+	return *(uint32_t*)&color;
+}
+
+static inline void clear_framebuffer_line(app_state *app, int y){
+	// Layers are cleared every frame by reset_framebuffers
+	(void)app;
+	(void)y;
+}
+
+static inline void compose_framebuffer_line(app_state *app, int y){
+	// The GPU composes the layers
+	(void)app;
+	(void)y;
+}
+
+static inline void fill_framebuffer_span(app_state *app, uint32_t z, int x, int y, int len, Color color){
+	// Fill a run of pixels on one line with a constant color
+	framebuffer_t *fb = &app->framebuffers[z];
+	fb->used_flag = true;
+
+	const uint32_t *swizzle;
+	uint32_t *data = get_framebuffer_line(fb, y, &swizzle);
+	uint32_t c = get_framebuffer_color(color);
+	for (int i=x; i<x+len; i++)
+		data[swizzle[i]] = c;
+}
+
+static inline void write_framebuffer_span(app_state *app, uint32_t z, int x, int y, int len, const Color *colors){
+	// Copy a run of colors, usually a tile row, to one line
+	framebuffer_t *fb = &app->framebuffers[z];
+	fb->used_flag = true;
 
-	return;
+	const uint32_t *swizzle;
+	uint32_t *data = get_framebuffer_line(fb, y, &swizzle);
+	for (int i=0; i<len; i++)
+		data[swizzle[x+i]] = get_framebuffer_color(colors[i]);
 }
 
 #endif
\ No newline at end of file
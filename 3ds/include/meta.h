@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include "utils.h"
 
+extern const float intensity_levels[];
+
+#define META_MAX_Z 64                   // Depths a store can ever accept
+
 #ifndef VERSION
 #define VERSION "0_0_0"
 #endif
@@ -18,11 +22,39 @@ typedef struct meta{
     uint32_t bg_for_z, bg_back_z;
     uint32_t win_z, obj_z, obj_behind_z;
 	uint32_t flags;
-	struct meta *next;
+	uint8_t bg_for_layer;               // The z values above remapped to
+	uint8_t bg_back_layer;              // the layers in use, see meta_store_t
+	uint8_t win_layer;
+	uint8_t obj_layer;
+	uint8_t obj_behind_layer;
+	Color bg_shades[4];                 // Colors lerped for each shade level,
+	Color win_shades[4];                // rebuilt whenever the colors change
+	Color obj_shades[4];
 } meta_t;
 
+typedef struct meta_slot{
+	uint32_t tile_hash;
+	uint32_t index;                     // Entry index + 1, 0 means empty slot
+} meta_slot_t;
+
+typedef struct meta_store{
+	meta_t *entries;                    // Metas, in insertion order
+	uint32_t count;
+	uint32_t capacity;
+	meta_slot_t *slots;                 // Open addressing index keyed on tile_hash
+	uint32_t slots_mask;
+	uint32_t generation;                // Bumped every time metas change
+	uint32_t z_limit;                   // Depths accepted are 0 to z_limit-1
+	uint32_t layers_count;              // Distinct depths in use, 0 always is
+	uint8_t z_layer[META_MAX_Z];        // Depth to layer, in depth order
+	uint8_t layer_z[META_MAX_Z];        // Layer to depth
+	uint32_t z_refs[META_MAX_Z];        // Meta z fields set to each depth
+	uint32_t layers_generation;         // Bumped every time the layers change
+} meta_store_t;
+
+void init_meta(meta_store_t *store, uint32_t z_limit);
 void set_meta(
-	meta_t **meta, 
+	meta_store_t *store, 
 	uint32_t hash, 
 	Color *bg_c, Color *win_c, Color *obj_c,
 	uint32_t *bg_for_z, uint32_t *bg_back_z, 
@@ -30,13 +62,15 @@ void set_meta(
 	uint32_t *obj_behind_z 
 );
 
-void meta_add_flags(meta_t *m, uint32_t flags);
-void meta_clear_flags(meta_t *m, uint32_t flags);
-void meta_set_flags(meta_t *m, uint32_t flags);
+void meta_build_shades(Color *shades, Color *tint);
+void meta_add_flags(meta_store_t *store, meta_t *m, uint32_t flags);
+void meta_clear_flags(meta_store_t *store, meta_t *m, uint32_t flags);
+void meta_set_flags(meta_store_t *store, meta_t *m, uint32_t flags);
 
-meta_t *get_meta(meta_t *meta, uint32_t hash);
-void free_meta(meta_t *meta);
-void save_meta(char* filename, meta_t *meta);
-int load_meta(char* filename, meta_t **meta);
+meta_t *get_meta(meta_store_t *store, uint32_t hash);
+meta_t *meta_next(meta_store_t *store, meta_t *m);
+void free_meta(meta_store_t *store);
+void save_meta(char* filename, meta_store_t *store);
+int load_meta(char* filename, meta_store_t *store);
 
 #endif
\ No newline at end of file
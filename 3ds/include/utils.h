@@ -41,7 +41,6 @@ typedef struct Color {
 uint32_t xy_to_i(uint32_t x, uint32_t y, uint32_t w);
 void get_swizzle_table(uint32_t *out, uint32_t w, uint32_t h);
 void copy_swizzle_tex(const uint32_t *table, uint32_t *src, C3D_Tex *dst, uint32_t n);
-unsigned int ComputeCRC32(unsigned char *data, int dataSize);
 Color ColorLerp(Color color1, Color color2, float factor);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "fingerprint.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FINGERPRINT_X86 1
+#else
+#define FINGERPRINT_X86 0
+#endif
+
+#define CRC32_POLY 0xEDB88320u
+
+static uint32_t crc_tables[8][256];
+
+/* <== CRC32 ===================================================> */
+
+uint32_t crc32_bytewise(const uint8_t *data, size_t len){
+	// Same algorithm as raylib's ComputeCRC32
+	uint32_t crc = ~0u;
+	for (size_t i=0; i<len; i++)
+		crc = (crc >> 8) ^ crc_tables[0][(data[i] ^ crc) & 0xFF];
+
+	return ~crc;
+}
+
+static uint32_t crc32_slice8_update(uint32_t crc, const uint8_t *data, size_t len){
+	// Consume 8 bytes per step, one table lookup per byte
+	while (len >= 8){
+		uint32_t lo, hi;
+		memcpy(&lo, data, sizeof(uint32_t));
+		memcpy(&hi, data + 4, sizeof(uint32_t));
+		lo ^= crc;
+		crc = crc_tables[7][lo & 0xFF]         ^ crc_tables[6][(lo >> 8) & 0xFF] ^
+		      crc_tables[5][(lo >> 16) & 0xFF] ^ crc_tables[4][lo >> 24]         ^
+		      crc_tables[3][hi & 0xFF]         ^ crc_tables[2][(hi >> 8) & 0xFF] ^
+		      crc_tables[1][(hi >> 16) & 0xFF] ^ crc_tables[0][hi >> 24];
+		data += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ crc_tables[0][(*data++ ^ crc) & 0xFF];
+
+	return crc;
+}
+
+uint32_t crc32_slice8(const uint8_t *data, size_t len){
+	return ~crc32_slice8_update(~0u, data, len);
+}
+
+#if FINGERPRINT_X86
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_pclmul(const uint8_t *data, size_t len){
+	// Carry-less multiplication folding (Intel, "Fast CRC Computation for
+	// Generic Polynomials Using PCLMULQDQ"), reflected CRC32 constants.
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+	if (len < 16)
+		return crc32_slice8(data, len);
+
+	__m128i x0, x1, x2, x3;
+	x1 = _mm_loadu_si128((const __m128i *)data);
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(~0));
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	data += 16;
+	len -= 16;
+
+	// Fold one 128 bit block at a time
+	while (len >= 16){
+		x2 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(x1, x2);
+		x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)data));
+		data += 16;
+		len -= 16;
+	}
+
+	// Fold 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	uint32_t crc = (uint32_t)_mm_extract_epi32(x1, 1);
+	return ~crc32_slice8_update(crc, data, len);
+}
+#endif
+
+/* <== Fingerprints ============================================> */
+
+static const fingerprint_impl_t crc32_impls[] = {
+	{ "bytewise", crc32_bytewise },
+	{ "slice8",   crc32_slice8   },
+#if FINGERPRINT_X86
+	{ "pclmul",   crc32_pclmul   },
+#endif
+};
+
+uint32_t (*fingerprint_crc32)(const uint8_t *data, size_t len) = crc32_bytewise;
+const fingerprint_impl_t *fingerprint_crc32_impl = &crc32_impls[0];
+
+void fingerprint_init(void){
+	// Build the slicing tables, crc_tables[0] is the classic byte table
+	for (uint32_t i=0; i<256; i++){
+		uint32_t c = i;
+		for (int k=0; k<8; k++)
+			c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		crc_tables[0][i] = c;
+	}
+
+	for (uint32_t i=0; i<256; i++){
+		for (int t=1; t<8; t++){
+			uint32_t c = crc_tables[t-1][i];
+			crc_tables[t][i] = (c >> 8) ^ crc_tables[0][c & 0xFF];
+		}
+	}
+
+	// Pick the fastest implementation this CPU supports
+	fingerprint_crc32_impl = &crc32_impls[1];
+#if FINGERPRINT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.2"))
+		fingerprint_crc32_impl = &crc32_impls[2];
+#endif
+	fingerprint_crc32 = fingerprint_crc32_impl->crc32;
+}
+
+int fingerprint_impls(const fingerprint_impl_t **impls){
+	// Returns every CRC32 implementation built in, for benchmarking
+	*impls = crc32_impls;
+	int count = sizeof(crc32_impls)/sizeof(crc32_impls[0]);
+#if FINGERPRINT_X86
+	if (fingerprint_crc32_impl != &crc32_impls[2]) count--;
+#endif
+	return count;
+}
+
+uint64_t fingerprint_fp64(const uint8_t *data, size_t len){
+	// Multiply-xorshift over 64 bit words, finalised like murmur3's fmix64
+	uint64_t h = 0x9E3779B97F4A7C15ull ^ (len * 0xC2B2AE3D27D4EB4Full);
+	while (len >= 8){
+		uint64_t w;
+		memcpy(&w, data, sizeof(uint64_t));
+		h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+		h ^= h >> 29;
+		data += 8;
+		len -= 8;
+	}
+
+	if (len > 0){
+		uint64_t w = 0;
+		memcpy(&w, data, len);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+	}
+
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t fingerprint(fingerprint_mode mode, const uint8_t *data, size_t len){
+	if (mode == FINGERPRINT_FP64)
+		return fingerprint_fp64(data, len);
+	return fingerprint_crc32(data, len);
+}
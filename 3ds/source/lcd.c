@@ -1,13 +1,43 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include "peanut_gb.h"
 #include "main.h"
 #include "utils.h"
+#include "lcd.h"
 
 const float intensity_levels[] = {
 	1.0f, 0.66f, 0.33f, 0.0f
 };
 
+// Shades used by tiles without meta
+static Color gray_shades[4];
+
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+// Sprites covering each line sorted by priority, rebuilt only when
+// OAM or the sprite size changes
+static struct sprite_line {
+    uint8_t count;
+    struct sprite_data sprites[MAX_SPRITES_LINE];
+} sprite_lines[LCD_HEIGHT];
+#endif
+
+// Tagged lines of the current frame
+static scanline_t scanlines[LCD_HEIGHT];
+
+// Incremental rendering, lines whose inputs did not change since the
+// last frame keep their layer contents
+static bool incremental = false;
+static bool verify = false;
+static uint32_t verify_failures = 0;
+static uint64_t line_signatures[LCD_HEIGHT];
+static bool line_valid[LCD_HEIGHT];         // Layers hold the line of the signature
+static bool line_drawn[LCD_HEIGHT];         // Drawn or kept during this frame
+
+// Spreads the 8 bits of a tile row byte into 8 bytes, one per pixel,
+// left to right ([0]) or mirrored for x flipped sprites ([1])
+static uint64_t row_spread[2][256];
+
 /* <== Utils ===================================================> */
 
 static int compare_sprites(const struct sprite_data *const sd1, const struct sprite_data *const sd2){
@@ -20,18 +50,20 @@ static int compare_sprites(const struct sprite_data *const sd1, const struct spr
 	return (int)sd1->sprite_number - (int)sd2->sprite_number;
 }
 
+static inline bool window_visible(gb_s *gb){
+    return gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE && 
+        gb->hram_io[IO_LY] >= gb->display.WY && 
+        gb->hram_io[IO_WX] <= 166;
+}
+
 static inline bool check_interlaced_line_skip(gb_s *gb){
 	if (!gb->direct.interlace) return false;
 	if ((!gb->display.interlace_count && (gb->hram_io[IO_LY] & 1) == 0) || 
 		(gb->display.interlace_count  && (gb->hram_io[IO_LY] & 1) == 1) ){
 		
 		/* Compensate for missing window draw if required. */
-		if (gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE && 
-			gb->hram_io[IO_LY] >= gb->display.WY && 
-			gb->hram_io[IO_WX] <= 166){
-			
+		if (window_visible(gb))
 			gb->display.window_clear++;
-		}
 
 		return true;
 	}
@@ -39,16 +71,248 @@ static inline bool check_interlaced_line_skip(gb_s *gb){
 	return false;
 }
 
-/* <== Render ==================================================> */
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+static void build_sprite_lines(gb_s *gb){
+    // Bucket every sprite into the lines it covers, keeping each line
+    // limited to the 10 sprites the Game Boy is able to render
+    int height = (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE) ? 16 : 8;
+
+    for (int y=0; y<LCD_HEIGHT; y++)
+        sprite_lines[y].count = 0;
+
+    for (uint8_t sprite_number = 0; sprite_number < NUM_SPRITES; sprite_number++){
+        // Sprite Y position.
+        int OY = gb->oam[4 * sprite_number + 0];
+
+        struct sprite_data current;
+        current.sprite_number = sprite_number;
+        current.x = gb->oam[4 * sprite_number + 1];
+
+        int top = OY - 16 < 0 ? 0 : OY - 16;
+        int bottom = MIN(OY - 16 + height, LCD_HEIGHT);
+
+        for (int y=top; y<bottom; y++){
+            struct sprite_line *line = &sprite_lines[y];
+
+            uint8_t place;
+            for (place = line->count; place != 0; place--){
+                if(compare_sprites(&line->sprites[place - 1], &current) < 0)
+                    break;
+            }
+
+            if(place >= MAX_SPRITES_LINE)
+                continue;
+
+            // Shift lower priority sprites down, dropping the last one
+            // if the line is full
+            for (uint8_t i = MIN(line->count, MAX_SPRITES_LINE - 1); i > place; --i){
+                line->sprites[i] = line->sprites[i - 1];
+            }
+
+            if(line->count < MAX_SPRITES_LINE)
+                line->count++;
+
+            line->sprites[place] = current;
+        }
+    }
+}
+
+static inline const struct sprite_line *get_sprite_line(gb_s *gb, int y){
+    if (gb->display.oam_dirty){
+        build_sprite_lines(gb);
+        gb->display.oam_dirty = false;
+    }
+
+    return &sprite_lines[y];
+}
+#endif
+
+static inline void fetch_tile_colors(const uint8_t *palette, const Color *shades, Color *colors){
+    // Resolve the color of each color index through the palette, once per tile
+    for (int i=0; i<4; i++)
+        colors[i] = shades[palette[i]];
+}
+
+static inline void decode_tile_row(uint8_t t1, uint8_t t2, bool flip, uint8_t *row){
+    // Decode a whole 2bpp tile row into 8 color indexes at once
+    uint64_t r = row_spread[flip][t1] | (row_spread[flip][t2] << 1);
+    memcpy(row, &r, sizeof(r));
+}
+
+static inline void tag_tile_row(tagged_pixel_t *dst, int x, tagged_pixel_t tag, const uint8_t *row, int start, int end){
+    // Whole tile rows are the common case, keep them a fixed size copy
+    if (start == 0 && end == 8){
+        for (int i=0; i<8; i++)
+            dst[x + i] = tag | row[i];
+        return;
+    }
+
+    for (int i=start; i<end; i++)
+        dst[x + i] = tag | row[i];
+}
+
+static inline bool tile_row_opaque(const tagged_pixel_t *row, int start, int end){
+    // Tells if any pixel has a non zero color index
+    tagged_pixel_t seen = 0;
+    for (int i=start; i<end; i++)
+        seen |= row[i];
+
+    return (seen & TAG_COLOR) != 0;
+}
+
+static inline bool same_color(Color a, Color b){
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static inline void draw_tile_row(app_state *app, uint32_t z, int x, int y, const tagged_pixel_t *row, const Color *colors, int start, int end){
+    // Write every pixel of a tile row as one span
+    Color span[LCD_WIDTH];
+    for (int i=start; i<end; i++)
+        span[i - start] = colors[row[i] & TAG_COLOR];
+
+    write_framebuffer_span(app, z, x + start, y, end - start, span);
+}
+
+static inline void draw_tile_row_opaque(app_state *app, uint32_t z, int x, int y, const tagged_pixel_t *row, const Color *colors, int start, int end){
+    // Write the runs of non zero color indexes, color 0 is transparent
+    Color span[LCD_WIDTH];
+    int i = start;
+    while (i < end){
+        while (i < end && !(row[i] & TAG_COLOR)) i++;
+
+        int run = i;
+        for (; i < end && (row[i] & TAG_COLOR); i++)
+            span[i - run] = colors[row[i] & TAG_COLOR];
+
+        if (i > run)
+            write_framebuffer_span(app, z, x + run, y, i - run, span);
+    }
+}
+
+static inline uint16_t get_bg_tile_addr(gb_s *gb, uint8_t idx){
+    // Select addressing mode.
+    if (gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+        return VRAM_TILES_1 + idx * 0x10;
+
+    return VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+}
+
+/* <== Signature ===============================================> */
+
+static inline uint64_t signature_mix(uint64_t h, uint64_t v){
+    // Multiply-xorshift step, as in fingerprint_fp64
+    h = (h ^ v) * 0xFF51AFD7ED558CCDull;
+    return h ^ (h >> 29);
+}
+
+static uint64_t signature_map_row(gb_s *gb, uint64_t h, uint16_t map, uint8_t map_x, int first_x, uint8_t py){
+    // Tile slots and tile data hashes of a map row from first_x to
+    // the end of the line, covering tile data changes and their meta
+    for (int x = first_x; x < LCD_WIDTH; x += 8){
+        uint16_t slot = get_bg_tile_addr(gb, gb->vram[map + ((uint8_t)(x - first_x + map_x) >> 3)]) / TILE_SIZE;
+        h = signature_mix(h, (uint64_t)get_tile_hash(gb, slot) << 16 | slot << 3 | py);
+    }
+
+    return h;
+}
+
+static uint64_t line_signature(gb_s *gb, app_state *app){
+    // Every input the line is rendered from: registers, palettes,
+    // map rows, tile data, sprites and the meta generation
+    uint8_t lcdc = gb->hram_io[IO_LCDC];
+    uint64_t regs, palettes;
+    uint64_t h = 0x9E3779B97F4A7C15ull;
+
+    regs = (uint64_t)lcdc | 
+        (uint64_t)gb->hram_io[IO_SCX] << 8 | 
+        (uint64_t)gb->hram_io[IO_SCY] << 16 |
+        (uint64_t)gb->hram_io[IO_WX] << 24 | 
+        (uint64_t)gb->display.WY << 32 | 
+        (uint64_t)gb->display.window_clear << 40;
+    h = signature_mix(h, regs);
+
+    memcpy(&palettes, gb->display.sp_palette, sizeof(palettes));
+    h = signature_mix(h, palettes);
+    palettes = 0;
+    memcpy(&palettes, gb->display.bg_palette, sizeof(gb->display.bg_palette));
+    h = signature_mix(h, palettes ^ (uint64_t)app->meta.generation << 32);
+
+    // Background
+    if (lcdc & LCDC_BG_ENABLE){
+        uint8_t bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
+        uint16_t bg_map = ((lcdc & LCDC_BG_MAP) ? VRAM_BMAP_2 : VRAM_BMAP_1) + (bg_y >> 3) * 0x20;
+        uint8_t scx = gb->hram_io[IO_SCX];
+        h = signature_map_row(gb, h, bg_map, scx & ~0x07, -(scx & 0x07), bg_y & 0x07);
+    }
+
+    // Window
+    if (window_visible(gb)){
+        uint16_t win_map = ((lcdc & LCDC_WINDOW_MAP) ? VRAM_BMAP_2 : VRAM_BMAP_1) + 
+            (gb->display.window_clear >> 3) * 0x20;
+        h = signature_map_row(gb, h, win_map, 0, gb->hram_io[IO_WX] - 7, gb->display.window_clear & 0x07);
+    }
+
+    // Sprites, the OAM entries and the tiles they draw from
+    if (lcdc & LCDC_OBJ_ENABLE){
+        uint8_t mask = (lcdc & LCDC_OBJ_SIZE) ? 0xFE : 0xFF;
+        #if PEANUT_GB_HIGH_LCD_ACCURACY
+            const struct sprite_line *sprites = get_sprite_line(gb, gb->hram_io[IO_LY]);
+            for (int i=0; i<sprites->count; i++){
+                uint8_t s = sprites->sprites[i].sprite_number;
+        #else
+            for (int s=0; s<NUM_SPRITES; s++){
+        #endif
+            uint32_t entry;
+            memcpy(&entry, &gb->oam[4 * s], sizeof(entry));
+            uint8_t OT = gb->oam[4 * s + 2] & mask;
+
+            h = signature_mix(h, entry);
+            h = signature_mix(h, (uint64_t)get_tile_hash(gb, OT) << 32 | get_tile_hash(gb, OT | (~mask & 1)));
+        }
+    }
+
+    return h;
+}
+
+static bool scanline_equal(const scanline_t *a, const scanline_t *b){
+    // Compares only what the paint pass reads
+    if (memcmp(a->bg_palette, b->bg_palette, sizeof(a->bg_palette)) ||
+        memcmp(a->sp_palette, b->sp_palette, sizeof(a->sp_palette)) ||
+        a->bg_offset != b->bg_offset || a->win_x != b->win_x ||
+        a->obj_count != b->obj_count)
+        return false;
+
+    if (memcmp(a->bg, b->bg, sizeof(a->bg)) || 
+        ((a->bg[0] & TAG_LAYER) && memcmp(a->bg_tiles, b->bg_tiles, (LCD_WIDTH + a->bg_offset + 7) / 8 * sizeof(uint32_t))))
+        return false;
+
+    int win_x = a->win_x < 0 ? 0 : a->win_x;
+    int win_tiles = (LCD_WIDTH - a->win_x + 7) / 8;
+    if (win_x < LCD_WIDTH && (
+        memcmp(&a->win[win_x], &b->win[win_x], (LCD_WIDTH - win_x) * sizeof(tagged_pixel_t)) || 
+        memcmp(a->win_tiles, b->win_tiles, win_tiles * sizeof(uint32_t))))
+        return false;
+
+    return !memcmp(a->obj, b->obj, a->obj_count * sizeof(scanline_obj_t));
+}
+
+/* <== Decode ==================================================> */
 
-static inline void render_background_line(gb_s *gb, uint8_t *pixels){
-    if (!(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)) return;
-    
+static inline uint32_t decode_tile_meta(gb_s *gb, uint16_t tile_i){
+    // Meta entry of a VRAM tile plus one, 0 if the tile has none
     app_state *app = gb->direct.priv;
-    uint8_t bg_y, disp_x, bg_x, idx, py, px, t1, t2;
+    meta_t *meta = get_tile_meta(app, tile_i);
+    return meta ? (uint32_t)(meta - app->meta.entries) + 1 : 0;
+}
+
+static inline void decode_background_line(gb_s *gb, scanline_t *line){
+    if (!(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)){
+        memset(line->bg, 0, sizeof(line->bg));
+        return;
+    }
+
+    uint8_t bg_y, py, row[8];
     uint16_t bg_map, tile;
-    uint32_t tile_hash;
-    meta_t *meta = NULL;
 
     // Calculate current background line to draw. Constant because
     // this function draws only this one line each time it is
@@ -61,251 +325,78 @@ static inline void render_background_line(gb_s *gb, uint8_t *pixels){
     // shift is to calculate the address.
     bg_map = ((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ? VRAM_BMAP_2 : VRAM_BMAP_1) + (bg_y >> 3) * 0x20;
 
-    // The displays (what the player sees) X coordinate, drawn right
-    // to left.
-    disp_x = LCD_WIDTH - 1;
-
-    // The X coordinate to begin drawing the background at.
-    bg_x = disp_x + gb->hram_io[IO_SCX];
-
-    // Get tile index for current background tile.
-    idx = gb->vram[bg_map + (bg_x >> 3)];
     // Y coordinate of tile pixel to draw.
     py = (bg_y & 0x07);
-    // X coordinate of tile pixel to draw.
-    px = 7 - (bg_x & 0x07);
-
-    // Select addressing mode.
-    if (gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT){
-        tile = VRAM_TILES_1 + idx * 0x10;
-    }	
-    else {
-        tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
-    }
-    
-    // fetch first tile
-    tile_hash = ComputeCRC32(&gb->vram[tile], TILE_SIZE);
-    meta = get_meta(app->meta, tile_hash);
-    tile += 2 * py;
-    t1 = gb->vram[tile] >> px;
-    t2 = gb->vram[tile + 1] >> px;
-
-    for (; disp_x != 0xFF; disp_x--){
-        uint8_t c;
-        if (px == 8){
-            // fetch next tile
-            px = 0;
-            bg_x = disp_x + gb->hram_io[IO_SCX];
-            idx = gb->vram[bg_map + (bg_x >> 3)];
-
-            if (gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT){
-                tile = VRAM_TILES_1 + idx * 0x10;
-            }
-            else {
-                tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
-            }
-                
-            tile_hash = ComputeCRC32(&gb->vram[tile], TILE_SIZE);
-            meta = get_meta(app->meta, tile_hash);
-            tile += 2 * py;
-            t1 = gb->vram[tile];
-            t2 = gb->vram[tile + 1];
-            
-        }
-
-        // write palette data to pixels 
-        // (used later because of transparency and sprite priority)
-        c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-        pixels[disp_x] = gb->display.bg_palette[c];
-        
-        // blit bg line to frame buffer (back)
-        uint32_t tile_back_z = 0;
-        float back_intensity = intensity_levels[gb->display.bg_palette[0] & 3];
-        Color back_color = (Color){
-            .r = back_intensity * 255,
-            .g = back_intensity * 255,
-            .b = back_intensity * 255,
-            .a = 255
-        };
-
-        if (meta != NULL){
-            tile_back_z = meta->bg_back_z;
-            back_color = ColorLerp(meta->bg_color, WHITE, back_intensity);
-        }
-            
-        draw_to_framebuffer(app, tile_back_z, disp_x, bg_y, back_color);
-
-        // blit bg line to frame buffer (front)
-        if (c > 0){
-            float front_intensity = intensity_levels[pixels[disp_x] & 3];
-            Color pixel_color = (Color){
-                .r = front_intensity * 255, 
-                .g = front_intensity * 255, 
-                .b = front_intensity * 255, 
-                .a = 255
-            };
-        
-            // apply custom metadata to tile
-            uint32_t tile_front_z = 0;
-            if (meta != NULL){
-                pixel_color = ColorLerp(meta->bg_color, WHITE, front_intensity);
-                tile_front_z = meta->bg_for_z;
-            }
-            draw_to_framebuffer(app, tile_front_z, disp_x, bg_y, pixel_color);
-        }
-        
-        t1 = t1 >> 1;
-        t2 = t2 >> 1;
-        px++;
+    line->bg_offset = gb->hram_io[IO_SCX] & 0x07;
+
+    // Decode one tile row per step, the first one may be partly
+    // scrolled out of the display.
+    for (int x = -line->bg_offset, n = 0; x < LCD_WIDTH; x += 8, n++){
+        uint8_t bg_x = x + gb->hram_io[IO_SCX];
+        tile = get_bg_tile_addr(gb, gb->vram[bg_map + (bg_x >> 3)]);
+        tagged_pixel_t tag = TAG_LAYER_BG | (tile / TILE_SIZE) << TAG_TILE_SHIFT;
+        line->bg_tiles[n] = get_tile_hash(gb, tile / TILE_SIZE);
+        line->bg_metas[n] = decode_tile_meta(gb, tile / TILE_SIZE);
+
+        tile += 2 * py;
+        decode_tile_row(gb->vram[tile], gb->vram[tile + 1], false, row);
+
+        int start = x < 0 ? -x : 0;
+        int end = MIN(LCD_WIDTH - x, 8);
+        tag_tile_row(line->bg, x, tag, row, start, end);
     }
 }
 
-static inline void render_window_line(gb_s *gb, uint8_t *pixels){
-    if (!(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE && gb->hram_io[IO_LY] >= gb->display.WY && gb->hram_io[IO_WX] <= 166 )) 
+static inline void decode_window_line(gb_s *gb, scanline_t *line){
+    line->win_x = LCD_WIDTH;
+    if (!window_visible(gb)) 
         return;
 
-    app_state *app = gb->direct.priv;
     uint16_t win_line, tile;
-    uint8_t disp_x, win_x, py, px, idx, t1, t2, end;
-    uint32_t tile_hash;
-    meta_t *meta = NULL;
-    
-    int line_y = gb->hram_io[IO_LY];
+    uint8_t py, row[8];
 
     // Calculate Window Map Address.
     win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
                 VRAM_BMAP_2 : VRAM_BMAP_1;
     win_line += (gb->display.window_clear >> 3) * 0x20;
 
-    disp_x = LCD_WIDTH - 1;
-    win_x = disp_x - gb->hram_io[IO_WX] + 7;
-
-    // look up tile
     py = gb->display.window_clear & 0x07;
-    px = 7 - (win_x & 0x07);
-    idx = gb->vram[win_line + (win_x >> 3)];
-
-    if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-        tile = VRAM_TILES_1 + idx * 0x10;
-    else
-        tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
-
-    // fetch first tile
-    tile_hash = ComputeCRC32(&t1, TILE_SIZE);
-    meta = get_meta(app->meta, tile_hash);
-    tile += 2 * py;
-    t1 = gb->vram[tile] >> px;
-    t2 = gb->vram[tile + 1] >> px;
-    
-
-    // loop & copy window
-    end = (gb->hram_io[IO_WX] < 7 ? 0 : gb->hram_io[IO_WX] - 7) - 1;
-
-    for(; disp_x != end; disp_x--)
-    {
-        uint8_t c;
-
-        if(px == 8)
-        {
-            // fetch next tile
-            px = 0;
-            win_x = disp_x - gb->hram_io[IO_WX] + 7;
-            idx = gb->vram[win_line + (win_x >> 3)];
-
-            if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-                tile = VRAM_TILES_1 + idx * 0x10;
-            else
-                tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
-
-            tile_hash = ComputeCRC32(&t1, TILE_SIZE);
-            meta = get_meta(app->meta, tile_hash);
-            tile += 2 * py;
-            t1 = gb->vram[tile];
-            t2 = gb->vram[tile + 1];
-        }
 
-        // write palette data to pixels 
-        // (used later because of transparency and sprite priority)
-        c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-        pixels[disp_x] = gb->display.bg_palette[c];
+    // The window starts at WX - 7 on the display, which may be
+    // left of its first column. Pixels left of it are not tagged.
+    line->win_x = gb->hram_io[IO_WX] - 7;
 
-        // blit win line to frame buffer
-        float intensity = intensity_levels[pixels[disp_x] & 3];
-        Color pixel_color = (Color){
-            .r = intensity * 255, 
-            .g = intensity * 255, 
-            .b = intensity * 255, 
-            .a = 255
-        };
-        
-        // apply custom metadata to tile
-        uint32_t tile_z = 0;
-        if (meta != NULL){
-            pixel_color = ColorLerp(meta->win_color, WHITE, intensity);
-            tile_z = meta->win_z;
-        }
-            
-        draw_to_framebuffer(app, tile_z, disp_x, line_y, pixel_color);
-        
-        t1 = t1 >> 1;
-        t2 = t2 >> 1;
-        tile_hash = ComputeCRC32(&t1, TILE_SIZE);
-        px++;
+    for (int x = line->win_x, n = 0; x < LCD_WIDTH; x += 8, n++){
+        uint8_t win_x = x - line->win_x;
+        tile = get_bg_tile_addr(gb, gb->vram[win_line + (win_x >> 3)]);
+        tagged_pixel_t tag = TAG_LAYER_WIN | (tile / TILE_SIZE) << TAG_TILE_SHIFT;
+        line->win_tiles[n] = get_tile_hash(gb, tile / TILE_SIZE);
+        line->win_metas[n] = decode_tile_meta(gb, tile / TILE_SIZE);
+
+        tile += 2 * py;
+        decode_tile_row(gb->vram[tile], gb->vram[tile + 1], false, row);
+
+        int start = x < 0 ? -x : 0;
+        int end = MIN(LCD_WIDTH - x, 8);
+        tag_tile_row(line->win, x, tag, row, start, end);
     }
 
     gb->display.window_clear++; // advance window line
 }
 
-static inline void render_sprites_line(gb_s *gb, uint8_t *pixels){
+static inline void decode_sprites_line(gb_s *gb, scanline_t *line){
+    line->obj_count = 0;
     if(!(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)) return;
 
-    app_state *app = gb->direct.priv;
     uint8_t sprite_number;
-    uint32_t tile_hash;
-    meta_t *meta;
 
     int line_y = gb->hram_io[IO_LY];
     #if PEANUT_GB_HIGH_LCD_ACCURACY
-        uint8_t number_of_sprites = 0;
-
-        struct sprite_data sprites_to_render[MAX_SPRITES_LINE];
-
-        // Record number of sprites on the line being rendered, limited
-        // to the maximum number sprites that the Game Boy is able to
-        // render on each line (10 sprites).
-        for (sprite_number = 0; sprite_number < NUM_SPRITES; sprite_number++){
-            // Sprite Y position.
-            uint8_t OY = gb->oam[4 * sprite_number + 0];
-            // Sprite X position.
-            uint8_t OX = gb->oam[4 * sprite_number + 1];
-
-            // If sprite isn't on this line, continue.
-            if (line_y + (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY || line_y + 16 < OY ){
-                continue;
-            }
-                
-            struct sprite_data current;
-            current.sprite_number = sprite_number;
-            current.x = OX;
-
-            uint8_t place;
-            for (place = number_of_sprites; place != 0; place--){
-                if(compare_sprites(&sprites_to_render[place - 1], &current) < 0)
-                    break;
-            }
-
-            if(place >= MAX_SPRITES_LINE)
-                continue;
-            
-            for (uint8_t i = number_of_sprites; i > place; --i){
-                sprites_to_render[i] = sprites_to_render[i - 1];
-            }
-
-            if(number_of_sprites < MAX_SPRITES_LINE)
-                number_of_sprites++;
-            
-            sprites_to_render[place] = current;
-        }
+        // Sprites on the line being rendered, already sorted and
+        // limited to the maximum the Game Boy is able to render.
+        const struct sprite_line *sprites = get_sprite_line(gb, line_y);
+        const struct sprite_data *sprites_to_render = sprites->sprites;
+        uint8_t number_of_sprites = sprites->count;
     #endif
 
     // Render each sprite, from low priority to high priority.
@@ -323,7 +414,7 @@ static inline void render_sprites_line(gb_s *gb, uint8_t *pixels){
         {
             uint8_t s = sprite_number;
     #endif
-        uint8_t py, t1, t2, dir, start, end, shift, disp_x;
+        uint8_t py, row[8];
         // Sprite Y position.
         uint8_t OY = gb->oam[4 * s + 0];
         // Sprite X position.
@@ -352,80 +443,239 @@ static inline void render_sprites_line(gb_s *gb, uint8_t *pixels){
         if(OF & OBJ_FLIP_Y)
             py = (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 15 : 7) - py;
 
-        // fetch the tile
-        tile_hash = ComputeCRC32(&(gb->vram[OT * 0x10]), TILE_SIZE);
-        meta = get_meta(app->meta, tile_hash);
-        t1 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py];
-        t2 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
-        
-        // handle x flip
-        if(OF & OBJ_FLIP_X)
-        {
-            dir = 1;
-            start = (OX < 8 ? 0 : OX - 8);
-            end = MIN(OX, LCD_WIDTH);
-            shift = 8 - OX + start;
+        tagged_pixel_t tag = TAG_LAYER_OBJ | OT << TAG_TILE_SHIFT;
+        if (OF & OBJ_PALETTE)
+            tag |= TAG_PALETTE;
+        if (OF & OBJ_PRIORITY)
+            tag |= TAG_PRIORITY;
+
+        // decode the row, mirrored when x flipped
+        uint16_t tile = VRAM_TILES_1 + OT * 0x10 + 2 * py;
+        decode_tile_row(gb->vram[tile], gb->vram[tile + 1], (OF & OBJ_FLIP_X) != 0, row);
+
+        scanline_obj_t *obj = &line->obj[line->obj_count++];
+        obj->x = OX - 8;
+        obj->start = obj->x < 0 ? -obj->x : 0;
+        obj->end = MIN(LCD_WIDTH - obj->x, 8);
+        obj->tile_hash = get_tile_hash(gb, OT);
+        obj->meta = decode_tile_meta(gb, OT);
+        for (int i=0; i<8; i++)
+            obj->px[i] = tag | row[i];
+    }
+}
+
+/* <== Paint ===================================================> */
+
+static inline meta_t *line_tile_meta(app_state *app, const scanline_t *line, uint32_t entry, uint32_t hash){
+    // Metas resolved while decoding hold until the store changes, a
+    // line painted again after that looks its tiles up by hash
+    if (line->meta_generation == app->meta.generation)
+        return entry ? &app->meta.entries[entry - 1] : NULL;
+    return get_meta(&app->meta, hash);
+}
+
+static inline void paint_background_line(app_state *app, const scanline_t *line, int y){
+    if (!(line->bg[0] & TAG_LAYER)) return;
+
+    const tagged_pixel_t *row = line->bg;
+    Color colors[4];
+
+    // Runs of the back plane sharing layer and color are filled at
+    // once, a constant background is a single fill per line.
+    int run_x = 0, run_len = 0;
+    uint32_t run_z = 0;
+    Color run_color = {0};
+
+    // Paint one tile row per step, the first one may be partly
+    // scrolled out of the display.
+    for (int x = -line->bg_offset, n = 0; x < LCD_WIDTH; x += 8, n++){
+        int start = x < 0 ? 0 : x;
+        int end = MIN(x + 8, LCD_WIDTH);
+
+        meta_t *meta = line_tile_meta(app, line, line->bg_metas[n], line->bg_tiles[n]);
+        fetch_tile_colors(line->bg_palette, meta ? meta->bg_shades : gray_shades, colors);
+        uint32_t back_z = meta ? meta->bg_back_layer : 0;
+        uint32_t for_z = meta ? meta->bg_for_layer : 0;
+        bool front = tile_row_opaque(row, start, end);
+
+        // blit bg line to frame buffer (back and front on the same layer)
+        if (front && for_z == back_z){
+            if (run_len)
+                fill_framebuffer_span(app, run_z, run_x, y, run_len, run_color);
+            run_len = 0;
+
+            draw_tile_row(app, for_z, 0, y, row, colors, start, end);
+            continue;
         }
-        else
-        {
-            dir = (uint8_t)-1;
-            start = MIN(OX, LCD_WIDTH) - 1;
-            end = (OX < 8 ? 0 : OX - 8) - 1;
-            shift = OX - (start + 1);
+
+        // blit bg line to frame buffer (back)
+        if (run_len && (back_z != run_z || !same_color(colors[0], run_color))){
+            fill_framebuffer_span(app, run_z, run_x, y, run_len, run_color);
+            run_len = 0;
         }
 
-        // copy tile
-        t1 >>= shift;
-        t2 >>= shift;
-
-        // TODO: Put for loop within the to if statements
-        // because the BG priority bit will be the same for
-        // all the pixels in the tile.
-        for(disp_x = start; disp_x != end; disp_x += dir){
-            uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-            // check transparency / sprite overlap / background overlap
-
-            //if(c && !(OF & OBJ_PRIORITY && !((pixels[disp_x] & 0x3) == gb->display.bg_palette[0]))){
-            if(c || (meta != NULL && (meta->flags & DRAW_OBJ_C0))){
-                bool render_behind = OF & OBJ_PRIORITY;
-            
-                // blit sprites line to frame buffer
-                float intensity = intensity_levels[
-                    (OF & OBJ_PALETTE) ? gb->display.sp_palette[c + 4] : gb->display.sp_palette[c]
-                ];
-
-                Color pixel_color = (Color){
-                    .r = intensity*255, 
-                    .g = intensity*255, 
-                    .b = intensity*255, 
-                    .a = 255
-                };
-
-                // apply custom metadata to tile
-                uint32_t tile_z = 0;
-                if (meta != NULL){
-                    pixel_color = ColorLerp(meta->obj_color, WHITE, intensity);
-                    tile_z = meta->obj_z;
-                    if (render_behind) 
-                        tile_z = meta->obj_behind_z;
-                }
-
-                draw_to_framebuffer(app, tile_z, disp_x, line_y, pixel_color);
-            }
+        if (!run_len){
+            run_x = start;
+            run_z = back_z;
+            run_color = colors[0];
+        }
+        run_len += end - start;
 
-            t1 = t1 >> 1;
-            t2 = t2 >> 1;
+        // blit bg line to frame buffer (front)
+        if (front)
+            draw_tile_row_opaque(app, for_z, 0, y, row, colors, start, end);
+    }
+
+    if (run_len)
+        fill_framebuffer_span(app, run_z, run_x, y, run_len, run_color);
+}
+
+static inline void paint_window_line(app_state *app, const scanline_t *line, int y){
+    const tagged_pixel_t *row = line->win;
+    Color colors[4];
+
+    for (int x = line->win_x, n = 0; x < LCD_WIDTH; x += 8, n++){
+        int start = x < 0 ? 0 : x;
+        int end = MIN(x + 8, LCD_WIDTH);
+
+        meta_t *meta = line_tile_meta(app, line, line->win_metas[n], line->win_tiles[n]);
+        fetch_tile_colors(line->bg_palette, meta ? meta->win_shades : gray_shades, colors);
+
+        // blit win line to frame buffer
+        draw_tile_row(app, meta ? meta->win_layer : 0, 0, y, row, colors, start, end);
+    }
+}
+
+static inline void paint_sprites_line(app_state *app, const scanline_t *line, int y){
+    Color colors[4];
+
+    for (int n=0; n<line->obj_count; n++){
+        const scanline_obj_t *obj = &line->obj[n];
+        tagged_pixel_t tag = obj->px[0];
+
+        // fetch the tile
+        meta_t *meta = line_tile_meta(app, line, obj->meta, obj->tile_hash);
+        fetch_tile_colors(
+            &line->sp_palette[(tag & TAG_PALETTE) ? 4 : 0], 
+            meta ? meta->obj_shades : gray_shades, 
+            colors
+        );
+
+        uint32_t tile_z = 0;
+        if (meta != NULL)
+            tile_z = (tag & TAG_PRIORITY) ? meta->obj_behind_layer : meta->obj_layer;
+
+        // check transparency / sprite overlap / background overlap
+        // (background priority is left to the z of the layers)
+
+        // blit sprites line to frame buffer
+        if (meta != NULL && (meta->flags & DRAW_OBJ_C0))
+            draw_tile_row(app, tile_z, obj->x, y, obj->px, colors, obj->start, obj->end);
+        else
+            draw_tile_row_opaque(app, tile_z, obj->x, y, obj->px, colors, obj->start, obj->end);
+    }
+}
+
+void lcd_init(void){
+    meta_build_shades(gray_shades, NULL);
+
+    for (int b=0; b<256; b++){
+        uint8_t row[8];
+        for (int i=0; i<8; i++)
+            row[i] = (b >> (7 - i)) & 1;
+        memcpy(&row_spread[0][b], row, sizeof(row));
+
+        for (int i=0; i<8; i++)
+            row[i] = (b >> i) & 1;
+        memcpy(&row_spread[1][b], row, sizeof(row));
+    }
+}
+
+void lcd_decode_line(gb_s *gb, scanline_t *line){
+    // First pass, turns the emulator state into tagged pixels
+    memcpy(line->bg_palette, gb->display.bg_palette, sizeof(line->bg_palette));
+    memcpy(line->sp_palette, gb->display.sp_palette, sizeof(line->sp_palette));
+    line->meta_generation = ((app_state *)gb->direct.priv)->meta.generation;
+    decode_background_line(gb, line);
+    decode_window_line(gb, line);
+    decode_sprites_line(gb, line);
+}
+
+void lcd_paint_line(app_state *app, const scanline_t *line, int y){
+    // Second pass, applies meta and paints the layers. Reads only the
+    // line and the meta store, never the emulator.
+    paint_background_line(app, line, y);
+    paint_window_line(app, line, y);
+    paint_sprites_line(app, line, y);
+}
+
+const scanline_t *lcd_get_scanline(int y){
+    return &scanlines[y];
+}
+
+void lcd_set_incremental(bool enabled, bool verify_lines){
+    incremental = enabled;
+    verify = enabled && verify_lines;
+    verify_failures = 0;
+    memset(line_valid, 0, sizeof(line_valid));
+}
+
+uint32_t lcd_verify_failures(void){
+    return verify_failures;
+}
+
+void lcd_finish_frame(app_state *app){
+    // Lines the emulator did not draw this frame (LCD off, interlacing)
+    // are left empty, as they would be with cleared layers
+    for (int y=0; y<LCD_HEIGHT; y++){
+        if (!line_drawn[y]){
+            clear_framebuffer_line(app, y);
+            line_valid[y] = false;
         }
+
+        line_drawn[y] = false;
     }
 }
 
 void lcd_render_line(gb_s *gb){
     if (gb->direct.frame_skip) return;
 	if (check_interlaced_line_skip(gb)) return;
-	
-	uint8_t pixels[LCD_WIDTH] = {0};
-    render_background_line(gb, pixels);
-    render_window_line(gb, pixels);
-    render_sprites_line(gb, pixels);
-    
-}
\ No newline at end of file
+
+    app_state *app = gb->direct.priv;
+    int y = gb->hram_io[IO_LY];
+    line_drawn[y] = true;
+
+    if (incremental){
+        uint64_t signature = line_signature(gb, app);
+        bool unchanged = line_valid[y] && line_signatures[y] == signature;
+        line_signatures[y] = signature;
+        line_valid[y] = true;
+
+        if (unchanged && !verify){
+            // Keep the layers, only advance the window line
+            if (window_visible(gb))
+                gb->display.window_clear++;
+            return;
+        }
+
+        if (unchanged){
+            // Check the kept line against a full decode
+            scanline_t line;
+            lcd_decode_line(gb, &line);
+            if (scanline_equal(&line, &scanlines[y]))
+                return;
+
+            verify_failures++;
+            scanlines[y] = line;
+            clear_framebuffer_line(app, y);
+            lcd_paint_line(app, &scanlines[y], y);
+            compose_framebuffer_line(app, y);
+            return;
+        }
+    }
+
+    clear_framebuffer_line(app, y);
+    lcd_decode_line(gb, &scanlines[y]);
+    lcd_paint_line(app, &scanlines[y], y);
+    compose_framebuffer_line(app, y);
+}
@@ -23,7 +23,6 @@
 
 #define CLEAR_COLOR 0x68B0D8FF
 #define TARGET_SPEED_US (1000000.0 / VERTICAL_SYNC)
-#define FRAMEBUFFER_BACKUPS 3
 
 #define DISPLAY_TRANSFER_FLAGS \
 	(GX_TRANSFER_FLIP_VERT(0) | GX_TRANSFER_OUT_TILED(0) | GX_TRANSFER_RAW_COPY(0) | \
@@ -65,18 +64,30 @@ static vertex_t plane_mesh[] = {
 
 C3D_Tex textures[Z_LAYERS*FRAMEBUFFER_BACKUPS];
 int backup = 0;
+tile_t tiles_on_vram[VRAM_TILE_COUNT];
 uint32_t swizzle_table[256*256];
 
 /* <== Framebuffers ============================================> */
 
 static inline void reset_framebuffers(app_state *app, int backup){
+	// Only the tile rows painted since this backup was last used are
+	// cleared, the rest of the texture is still transparent
 	for (int i=0; i<Z_LAYERS; i++){
-		if (!app->framebuffers[i].used_flag) continue;
-		app->framebuffers[i].copy = NULL;
-		app->framebuffers[i].used_flag = false;
-		
-		C3D_Tex *tex = get_framebuffer_tex(&app->framebuffers[i],backup);
-		memset(tex->data, 0, sizeof(uint32_t)*256*256);
+		framebuffer_t *fb = &app->framebuffers[i];
+		fb->copy = NULL;
+		fb->used_flag = false;
+
+		uint32_t *data = get_framebuffer_tex(fb, backup)->data;
+		uint32_t rows = fb->painted_rows[backup];
+		fb->painted_rows[backup] = 0;
+		while (rows){
+			int row = __builtin_ctz(rows);
+			rows &= rows - 1;
+
+			// The tiles of a row are contiguous, the LCD covers 20 of them
+			uint32_t start = swizzle_table[row*8*256 + 48] & ~63u;
+			memset(&data[start], 0, sizeof(uint32_t)*64*(LCD_WIDTH/8));
+		}
 	}
 }
 
@@ -163,6 +174,8 @@ void gb_error(gb_s *gb, const enum gb_error_e gb_err, const uint16_t val){
 
 static int app_init(app_state *app, char* rom_filename){
 	memset(app, 0, sizeof(*app));
+	init_meta(&app->meta, Z_LAYERS);
+	fingerprint_init();
 	
 	// Copy input ROM file to allocated memory (esto aloja memoria)
 	app->rom = read_rom_to_ram(rom_filename);
@@ -192,6 +205,7 @@ static int app_init(app_state *app, char* rom_filename){
 
 	// Init LCD
 	gb_init_lcd(&app->gb, &lcd_render_line);
+	lcd_init();
 	app->gb.direct.interlace = true;
 	app->gb.direct.frame_skip = true;
 
@@ -200,8 +214,9 @@ static int app_init(app_state *app, char* rom_filename){
 		app->framebuffers[i].tex = &textures[i];
 	}
 	
-	for (int i=0; i<FRAMEBUFFER_BACKUPS; i++){
-		reset_framebuffers(app,i);
+	// Textures start transparent, from here on only painted rows get cleared
+	for (int i=0; i<Z_LAYERS*FRAMEBUFFER_BACKUPS; i++){
+		memset(textures[i].data, 0, sizeof(uint32_t)*256*256);
 	}
 	
 	return 0;
@@ -241,15 +256,18 @@ static void draw_scene(float iod){
 
 	C3D_FVUnifMtx4x4(GPU_VERTEX_SHADER, projection_uniform, &projection);
 	
-	for (int i=0; i<Z_LAYERS; i++){
+	// Only the layers of depths the metas use, each one drawn at its
+	// depth with copies down to 0
+	for (int i=0; i<(int)app.meta.layers_count; i++){
 		framebuffer_t *fb = &app.framebuffers[i];
 		if (!fb->used_flag && fb->copy == NULL)
 			continue;
 		
+		int depth = app.meta.layer_z[i];
 		int k=backup+1;
 		if (k >= FRAMEBUFFER_BACKUPS) k=0;
 		for (int j=0; j<FRAMEBUFFER_BACKUPS; j++){
-			draw_plane(PLANES_DISTANCE*i, i+1, get_framebuffer_tex(fb->copy != NULL ? fb->copy:fb, k));
+			draw_plane(PLANES_DISTANCE*depth, depth+1, get_framebuffer_tex(fb->copy != NULL ? fb->copy:fb, k));
 			k++;
 			if (k >= FRAMEBUFFER_BACKUPS) k=0;
 		}
@@ -347,7 +365,7 @@ static void cleanup(void){
 	C3D_Fini();
 	gfxExit();
 
-	free_meta(app.meta);
+	free_meta(&app.meta);
 }
 
 void handle_input(){
@@ -1,86 +1,275 @@
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "meta.h"
 
+#define META_MIN_SLOTS 16
+#define META_MAX_COUNT (1u << 24)            // Far over any profile, keeps the index math in range
+#define META_RECORD_SIZE (4 + 3*sizeof(Color) + 6*4) // One meta in a 0_1_0 file
+
+/* <== Store ===================================================> */
+
+static meta_slot_t *find_slot(meta_store_t *store, uint32_t hash){
+	// tile_hash is a CRC32, so its low bits are already well spread
+	uint32_t i = hash & store->slots_mask;
+	while (true){
+		meta_slot_t *slot = &store->slots[i];
+		if (slot->index == 0 || slot->tile_hash == hash)
+			return slot;
+		
+		i = (i + 1) & store->slots_mask;
+	}
+}
+
+static bool grow_slots(meta_store_t *store, uint32_t slots_q){
+	// The old index is kept if the new one can not be allocated
+	meta_slot_t *slots = calloc(slots_q, sizeof(meta_slot_t));
+	if (slots == NULL) return false;
+
+	free(store->slots);
+	store->slots = slots;
+	store->slots_mask = slots_q - 1;
+
+	// Re-index every entry
+	for (uint32_t i=0; i<store->count; i++){
+		meta_slot_t *slot = find_slot(store, store->entries[i].tile_hash);
+		slot->tile_hash = store->entries[i].tile_hash;
+		slot->index = i + 1;
+	}
+	return true;
+}
+
+static bool reserve_meta(meta_store_t *store, size_t count){
+	// Room for count metas, false with the store untouched if there is
+	// no memory for them. Capped so doubling never wraps.
+	if (count > META_MAX_COUNT) return false;
+
+	// Entries array
+	if (count > store->capacity){
+		size_t capacity = store->capacity ? store->capacity : META_MIN_SLOTS/2;
+		while (capacity < count) capacity *= 2;
+
+		meta_t *entries = realloc(store->entries, capacity*sizeof(meta_t));
+		if (entries == NULL) return false;
+		store->entries = entries;
+		store->capacity = capacity;
+	}
+
+	// Keep the index at most half full, so probes stay short
+	size_t slots_q = store->slots ? (size_t)store->slots_mask + 1 : 0;
+	if (count*2 > slots_q){
+		if (slots_q == 0) slots_q = META_MIN_SLOTS;
+		while (count*2 > slots_q) slots_q *= 2;
+		if (!grow_slots(store, slots_q)) return false;
+	}
+	return true;
+}
+
+static meta_t *insert_meta(meta_store_t *store, uint32_t hash, bool *created){
+	// NULL when the store is out of memory
+	if (!reserve_meta(store, (size_t)store->count + 1))
+		return NULL;
+
+	meta_slot_t *slot = find_slot(store, hash);
+	*created = slot->index == 0;
+	if (!*created)
+		return &store->entries[slot->index - 1];
+
+	meta_t *m = &store->entries[store->count++];
+	slot->tile_hash = hash;
+	slot->index = store->count;
+	m->tile_hash = hash;
+	return m;
+}
+
+/* <== Layers ==================================================> */
+
+static void count_z_refs(meta_store_t *store, const meta_t *m, int32_t delta){
+	store->z_refs[m->bg_for_z] += delta;
+	store->z_refs[m->bg_back_z] += delta;
+	store->z_refs[m->win_z] += delta;
+	store->z_refs[m->obj_z] += delta;
+	store->z_refs[m->obj_behind_z] += delta;
+}
+
+static uint64_t used_depths(const meta_store_t *store){
+	// Depth 0 is always in use, tiles without meta are painted there
+	uint64_t used = 1;
+	for (uint32_t z=0; z<META_MAX_Z; z++)
+		if (store->z_refs[z]) used |= (uint64_t)1 << z;
+	return used;
+}
+
+static void set_meta_layers(meta_store_t *store, meta_t *m){
+	m->bg_for_layer = store->z_layer[m->bg_for_z];
+	m->bg_back_layer = store->z_layer[m->bg_back_z];
+	m->win_layer = store->z_layer[m->win_z];
+	m->obj_layer = store->z_layer[m->obj_z];
+	m->obj_behind_layer = store->z_layer[m->obj_behind_z];
+}
+
+static void remap_layers(meta_store_t *store){
+	// Give every depth in use a layer, in depth order. Only needed
+	// when a depth starts or stops being used.
+	uint64_t used = used_depths(store);
+	uint8_t layer_z[META_MAX_Z];
+	uint32_t count = 0;
+	for (uint32_t z=0; z<META_MAX_Z; z++){
+		if (!(used & ((uint64_t)1 << z))) continue;
+		store->z_layer[z] = count;
+		layer_z[count++] = z;
+	}
+
+	if (count != store->layers_count || memcmp(layer_z, store->layer_z, count)){
+		memcpy(store->layer_z, layer_z, count);
+		store->layers_count = count;
+		store->layers_generation++;
+	}
+
+	for (meta_t *m=meta_next(store, NULL); m != NULL; m=meta_next(store, m))
+		set_meta_layers(store, m);
+}
+
+static bool z_valid(meta_store_t *store, uint32_t *z){
+	return z == NULL || *z < store->z_limit;
+}
+
+void init_meta(meta_store_t *store, uint32_t z_limit){
+	memset(store, 0, sizeof(*store));
+	store->z_limit = z_limit < META_MAX_Z ? z_limit : META_MAX_Z;
+	remap_layers(store);
+}
+
+/* <== Meta ====================================================> */
+
 void set_meta(
-	meta_t **meta, 
+	meta_store_t *store, 
 	uint32_t hash, 
 	Color *bg_c, Color *win_c, Color *obj_c,
 	uint32_t *bg_for_z, uint32_t *bg_back_z, 
 	uint32_t *win_z, uint32_t *obj_z,
 	uint32_t *obj_behind_z ){
 	
-		while (true){
-			if (*meta == NULL){
-				*meta = malloc(1*sizeof(meta_t));
-				(*meta)->tile_hash = hash;
-				(*meta)->next = NULL;
-				(*meta)->bg_color = BLACK;
-				(*meta)->win_color = BLACK;
-				(*meta)->obj_color = BLACK;
-				(*meta)->bg_for_z = 0;
-				(*meta)->bg_back_z = 0;
-				(*meta)->win_z = 0;
-				(*meta)->obj_z = 0;
-				(*meta)->obj_behind_z = 0;
-				(*meta)->flags = 0;
-
-				//printf("New meta created for tile:%u\n", hash);
-				break;
-			}
-			
-			if ((*meta)->tile_hash == hash)
-				break;
-			
-			meta = &(*meta)->next;
+		// Reject the whole update, a z out of range would paint no layer
+		if (!z_valid(store, bg_for_z) || !z_valid(store, bg_back_z) || 
+			!z_valid(store, win_z) || !z_valid(store, obj_z) || 
+			!z_valid(store, obj_behind_z)){
+			printf("ERROR: z out of range, 0 to %u\n", store->z_limit - 1);
+			return;
 		}
+
+		bool created;
+		meta_t *m = insert_meta(store, hash, &created);
+		if (m == NULL){
+			printf("ERROR: no memory for another meta\n");
+			return;
+		}
+		store->generation++;
+		uint64_t used = used_depths(store);
+		if (created){
+			m->bg_color = BLACK;
+			m->win_color = BLACK;
+			m->obj_color = BLACK;
+			m->bg_for_z = 0;
+			m->bg_back_z = 0;
+			m->win_z = 0;
+			m->obj_z = 0;
+			m->obj_behind_z = 0;
+			m->flags = 0;
+
+			//printf("New meta created for tile:%u\n", hash);
+		}
+		else
+			count_z_refs(store, m, -1);      // Counted again below, with the new z
 		
-		if (bg_c != NULL)      (*meta)->bg_color = *bg_c;       // BACKGROUND COLOR
-		if (win_c != NULL)     (*meta)->win_color = *win_c;     // WINDOW COLOR
-		if (obj_c != NULL)     (*meta)->obj_color = *obj_c;     // OBJECT COLOR
-		if (bg_for_z != NULL)  (*meta)->bg_for_z = *bg_for_z;   // BACKGROUND Z FORWARD
-		if (bg_back_z != NULL) (*meta)->bg_back_z = *bg_back_z; // BACKGROUND Z BACK
-		if (win_z != NULL)     (*meta)->win_z = *win_z;         // WINDOW Z
-		if (obj_z != NULL)     (*meta)->obj_z = *obj_z;         // OBJECT Z
+		if (bg_c != NULL)      m->bg_color = *bg_c;       // BACKGROUND COLOR
+		if (win_c != NULL)     m->win_color = *win_c;     // WINDOW COLOR
+		if (obj_c != NULL)     m->obj_color = *obj_c;     // OBJECT COLOR
+		if (bg_for_z != NULL)  m->bg_for_z = *bg_for_z;   // BACKGROUND Z FORWARD
+		if (bg_back_z != NULL) m->bg_back_z = *bg_back_z; // BACKGROUND Z BACK
+		if (win_z != NULL)     m->win_z = *win_z;         // WINDOW Z
+		if (obj_z != NULL)     m->obj_z = *obj_z;         // OBJECT Z
 
 		// OBJECT BEHIND Z
-		if (obj_behind_z != NULL) (*meta)->obj_behind_z = *obj_behind_z;
+		if (obj_behind_z != NULL) m->obj_behind_z = *obj_behind_z;
+
+		meta_build_shades(m->bg_shades, &m->bg_color);
+		meta_build_shades(m->win_shades, &m->win_color);
+		meta_build_shades(m->obj_shades, &m->obj_color);
+
+		// Remap all metas only when a depth starts or stops being used
+		count_z_refs(store, m, 1);
+		if (used_depths(store) != used)
+			remap_layers(store);
+		else
+			set_meta_layers(store, m);
 
 		printf("Meta updated for tile:%u\n", hash);
 }
 
-void meta_add_flags(meta_t *m, uint32_t flags) {
+void meta_build_shades(Color *shades, Color *tint){
+	// Precompute the color of each shade level, plain gray without tint
+	for (int i=0; i<4; i++){
+		float intensity = intensity_levels[i];
+		if (tint != NULL)
+			shades[i] = ColorLerp(*tint, WHITE, intensity);
+		else 
+			shades[i] = (Color){
+				.r = intensity * 255,
+				.g = intensity * 255,
+				.b = intensity * 255,
+				.a = 255
+			};
+	}
+}
+
+void meta_add_flags(meta_store_t *store, meta_t *m, uint32_t flags) {
     m->flags |= flags;
+    store->generation++;
 }
 
-void meta_clear_flags(meta_t *m, uint32_t flags) {
+void meta_clear_flags(meta_store_t *store, meta_t *m, uint32_t flags) {
     m->flags &= ~flags;
+    store->generation++;
 }
 
-void meta_set_flags(meta_t *m, uint32_t flags) {
+void meta_set_flags(meta_store_t *store, meta_t *m, uint32_t flags) {
     m->flags = flags;
+    store->generation++;
 }
 
-meta_t *get_meta(meta_t *meta, uint32_t hash){
-	for (meta_t *m = meta; m != NULL; m=m->next){
-        if (m->tile_hash == hash) return m;
-    }
-    return NULL;
+meta_t *get_meta(meta_store_t *store, uint32_t hash){
+	if (store->slots == NULL) return NULL;
+
+	meta_slot_t *slot = find_slot(store, hash);
+	if (slot->index == 0) return NULL;
+	return &store->entries[slot->index - 1];
 }
 
-void free_meta(meta_t *meta){
-	for (meta_t *m=meta; m != NULL;){
-		meta_t *prev = m;
-		m=m->next;
-		free(prev);
-	}
+meta_t *meta_next(meta_store_t *store, meta_t *m){
+	// Iterates the metas in insertion order, starting from NULL
+	m = (m == NULL) ? store->entries : m + 1;
+	if (m >= store->entries + store->count) return NULL;
+	return m;
 }
 
-void save_meta(char* filename, meta_t *meta){
+void free_meta(meta_store_t *store){
+	uint32_t generation = store->generation;
+	uint32_t layers_generation = store->layers_generation;
+	uint32_t z_limit = store->z_limit;
+	free(store->entries);
+	free(store->slots);
+	init_meta(store, z_limit);
+	store->generation = generation + 1;
+	store->layers_generation = layers_generation + 1;
+}
+
+void save_meta(char* filename, meta_store_t *store){
 	char meta_path[6 + strlen(filename)];
 	sprintf(meta_path, "meta/%s", filename);
 	int fd = open(meta_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
@@ -95,13 +284,11 @@ void save_meta(char* filename, meta_t *meta){
 	write(fd, version_buf, 10);
 
 	// STORE THE META COUNT
-	uint32_t meta_q = 0;
-	for (meta_t *m=meta; m != NULL; m=m->next)
-		meta_q++;
+	uint32_t meta_q = store->count;
 	write(fd, &meta_q, sizeof(uint32_t));
 
 	// STORE EACH META
-	for (meta_t *m=meta; m != NULL; m=m->next){
+	for (meta_t *m=meta_next(store, NULL); m != NULL; m=meta_next(store, m)){
 		write(fd, &m->tile_hash, sizeof(uint32_t));
 		write(fd, &m->bg_color, sizeof(Color));
 		write(fd, &m->win_color, sizeof(Color));
@@ -117,33 +304,76 @@ void save_meta(char* filename, meta_t *meta){
 	close(fd);
 }
 
-void load_meta_0_1_0(int fd, meta_t **meta){
+void load_meta_0_1_0(int fd, meta_store_t *store){
+	// Metas are read into a new store, the old one is only replaced once
+	// the whole file is in
 	//printf("loading_meta_0_1_0\n");
-	free_meta(*meta);
+	meta_store_t loaded;
+	init_meta(&loaded, store->z_limit);
+
+	// READ THE META COUNT, checked against what is left of the file
+	uint32_t meta_q, rejected = 0;
+	struct stat st;
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (read(fd, &meta_q, sizeof(uint32_t)) != sizeof(uint32_t) || fstat(fd, &st) || offset < 0 || 
+		meta_q > (st.st_size - offset - sizeof(uint32_t)) / META_RECORD_SIZE){
+		printf("ERROR: meta file truncated or corrupt, metas kept\n");
+		return;
+	}
 
-	// READ THE META COUNT
-	uint32_t meta_q;
-	read(fd, &meta_q, sizeof(uint32_t));
+	if (!reserve_meta(&loaded, meta_q)){
+		printf("ERROR: no memory for %u metas, metas kept\n", meta_q);
+		return;
+	}
 
 	// READ EACH META STRUCTURE
-	for (int i=0; i<meta_q; i++){
-		*meta = malloc(sizeof(meta_t));
-		(*meta)->next = NULL;
-		read(fd, &(*meta)->tile_hash, sizeof(uint32_t));
-		read(fd, &(*meta)->bg_color, sizeof(Color));
-		read(fd, &(*meta)->win_color, sizeof(Color));
-		read(fd, &(*meta)->obj_color, sizeof(Color));
-		read(fd, &(*meta)->bg_for_z, sizeof(uint32_t));
-		read(fd, &(*meta)->bg_back_z, sizeof(uint32_t));
-		read(fd, &(*meta)->win_z, sizeof(uint32_t));
-		read(fd, &(*meta)->obj_z, sizeof(uint32_t));
-		read(fd, &(*meta)->obj_behind_z, sizeof(uint32_t));
-		read(fd, &(*meta)->flags, sizeof(uint32_t));
-		meta = &(*meta)->next;
+	for (uint32_t i=0; i<meta_q; i++){
+		meta_t m;
+		read(fd, &m.tile_hash, sizeof(uint32_t));
+		read(fd, &m.bg_color, sizeof(Color));
+		read(fd, &m.win_color, sizeof(Color));
+		read(fd, &m.obj_color, sizeof(Color));
+		read(fd, &m.bg_for_z, sizeof(uint32_t));
+		read(fd, &m.bg_back_z, sizeof(uint32_t));
+		read(fd, &m.win_z, sizeof(uint32_t));
+		read(fd, &m.obj_z, sizeof(uint32_t));
+		read(fd, &m.obj_behind_z, sizeof(uint32_t));
+		read(fd, &m.flags, sizeof(uint32_t));
+		meta_build_shades(m.bg_shades, &m.bg_color);
+		meta_build_shades(m.win_shades, &m.win_color);
+		meta_build_shades(m.obj_shades, &m.obj_color);
+
+		// Skip metas of profiles made for more depths than there are
+		if (!z_valid(&loaded, &m.bg_for_z) || !z_valid(&loaded, &m.bg_back_z) || 
+			!z_valid(&loaded, &m.win_z) || !z_valid(&loaded, &m.obj_z) || 
+			!z_valid(&loaded, &m.obj_behind_z)){
+			rejected++;
+			continue;
+		}
+
+		// Reserved up front, inserting can not fail. A tile listed
+		// twice keeps its last meta.
+		bool created;
+		meta_t *slot = insert_meta(&loaded, m.tile_hash, &created);
+		if (!created)
+			count_z_refs(&loaded, slot, -1);
+		*slot = m;
+		count_z_refs(&loaded, slot, 1);
 	}
+
+	if (rejected)
+		printf("%u metas skipped, z out of range 0 to %u\n", rejected, loaded.z_limit - 1);
+
+	// SWAP THE STORES, every generation moves on
+	loaded.generation = store->generation + 1;
+	loaded.layers_generation = store->layers_generation + 1;
+	free(store->entries);
+	free(store->slots);
+	*store = loaded;
+	remap_layers(store);
 }
 
-int load_meta(char* filename, meta_t **meta){
+int load_meta(char* filename, meta_store_t *store){
 	int fd = open(filename, O_RDONLY);
 	if (fd < 0){
 		svcBreak(USERBREAK_PANIC);
@@ -153,7 +383,7 @@ int load_meta(char* filename, meta_t **meta){
 	char version_buf[10] = {0};
 	read(fd, version_buf, 10);
 	if (strcmp(version_buf, "0_1_0") == 0){
-		load_meta_0_1_0(fd, meta);
+		load_meta_0_1_0(fd, store);
 	}
 	
 	close(fd);
@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <string.h>
+#include "abuffer.h"
+
+// Alpha is the last byte of a Color, the top byte of its pixel
+#define ALPHA_MASK 0xFF000000u
+
+/* <== Fragments ===============================================> */
+
+void abuffer_clear_row(abuffer_t *ab, int y){
+	for (int x=0; x<LCD_WIDTH; x++)
+		ab->pixels[y][x].count = 0;
+}
+
+void abuffer_fill_span(abuffer_t *ab, uint8_t z, int x, int y, int len, uint32_t color){
+	abuffer_pixel_t *row = &ab->pixels[y][x];
+	for (int i=0; i<len; i++)
+		abuffer_insert(ab, &row[i], z, color);
+}
+
+void abuffer_write_span(abuffer_t *ab, uint8_t z, int x, int y, int len, const uint32_t *colors){
+	abuffer_pixel_t *row = &ab->pixels[y][x];
+	for (int i=0; i<len; i++)
+		abuffer_insert(ab, &row[i], z, colors[i]);
+}
+
+/* <== Resolve =================================================> */
+
+static inline uint32_t resolve_pixel(const abuffer_pixel_t *p, uint8_t z){
+	// Front-most opaque fragment at z or over it, the same pixel the
+	// framebuffer of layer z gets when composing full layers
+	for (int i=0; i<p->count && p->z[i] >= z; i++){
+		if ((p->color[i] & ALPHA_MASK) || p->z[i] == z)
+			return p->color[i];
+	}
+
+	return 0;
+}
+
+void abuffer_resolve_composite(const abuffer_t *ab, uint32_t *out){
+	abuffer_resolve_stack(ab, 0, out);
+}
+
+void abuffer_resolve_stack(const abuffer_t *ab, uint8_t z, uint32_t *out){
+	// Layer z with every layer over it
+	const abuffer_pixel_t *p = &ab->pixels[0][0];
+	for (int i=0; i<LCD_WIDTH*LCD_HEIGHT; i++)
+		out[i] = resolve_pixel(&p[i], z);
+}
+
+void abuffer_resolve_layer(const abuffer_t *ab, uint8_t z, uint32_t *out){
+	// Only the fragments painted on layer z
+	const abuffer_pixel_t *p = &ab->pixels[0][0];
+	memset(out, 0, LCD_WIDTH*LCD_HEIGHT*sizeof(uint32_t));
+
+	for (int i=0; i<LCD_WIDTH*LCD_HEIGHT; i++){
+		for (int k=0; k<p[i].count && p[i].z[k] >= z; k++){
+			if (p[i].z[k] == z) out[i] = p[i].color[k];
+		}
+	}
+}
+
+void abuffer_resolve_depth(const abuffer_t *ab, uint8_t *out){
+	// z of the front-most opaque fragment of every pixel
+	const abuffer_pixel_t *p = &ab->pixels[0][0];
+	for (int i=0; i<LCD_WIDTH*LCD_HEIGHT; i++){
+		out[i] = ABUFFER_NO_DEPTH;
+		for (int k=0; k<p[i].count; k++){
+			if (p[i].color[k] & ALPHA_MASK){
+				out[i] = p[i].z[k];
+				break;
+			}
+		}
+	}
+}
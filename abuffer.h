@@ -0,0 +1,58 @@
+#ifndef ABUFFER_H
+#define ABUFFER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "peanut_gb.h"
+
+#define ABUFFER_FRAGMENTS 4                 // Fragments kept per pixel
+#define ABUFFER_NO_DEPTH 0xFF               // Depth of a pixel with no opaque fragment
+
+// Fragments of a pixel sorted by z, front (highest z) first
+typedef struct abuffer_pixel{
+	uint8_t count;
+	uint8_t z[ABUFFER_FRAGMENTS];
+	uint32_t color[ABUFFER_FRAGMENTS];
+} abuffer_pixel_t;
+
+typedef struct abuffer{
+	abuffer_pixel_t pixels[LCD_HEIGHT][LCD_WIDTH];
+	uint64_t overflows;                     // Fragments dropped because a pixel was full
+} abuffer_t;
+
+void abuffer_clear_row(abuffer_t *ab, int y);
+void abuffer_fill_span(abuffer_t *ab, uint8_t z, int x, int y, int len, uint32_t color);
+void abuffer_write_span(abuffer_t *ab, uint8_t z, int x, int y, int len, const uint32_t *colors);
+
+// Resolves, on demand, into full screen images
+void abuffer_resolve_composite(const abuffer_t *ab, uint32_t *out);
+void abuffer_resolve_layer(const abuffer_t *ab, uint8_t z, uint32_t *out);
+void abuffer_resolve_stack(const abuffer_t *ab, uint8_t z, uint32_t *out);
+void abuffer_resolve_depth(const abuffer_t *ab, uint8_t *out);
+
+static inline void abuffer_insert(abuffer_t *ab, abuffer_pixel_t *p, uint8_t z, uint32_t color){
+	// Replace the fragment of the same z or insert it in order, when the
+	// pixel is full the fragment furthest back is dropped
+	int i = 0;
+	while (i < p->count && p->z[i] > z) i++;
+
+	if (i < p->count && p->z[i] == z){
+		p->color[i] = color;
+		return;
+	}
+
+	if (p->count == ABUFFER_FRAGMENTS){
+		ab->overflows++;
+		if (i == ABUFFER_FRAGMENTS) return;
+	}
+	else p->count++;
+
+	for (int k = p->count - 1; k > i; k--){
+		p->z[k] = p->z[k - 1];
+		p->color[k] = p->color[k - 1];
+	}
+	p->z[i] = z;
+	p->color[i] = color;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+int arena_init(arena_t *arena, size_t size, arena_pages_t pages){
+	// Huge pages fall back to advised ones and those to normal pages,
+	// pages tells what it got. Returns 0 on success.
+	memset(arena, 0, sizeof(arena_t));
+
+#if defined(__linux__)
+	size = (size + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+	void *block = MAP_FAILED;
+
+#if defined(MAP_HUGETLB)
+	if (pages == ARENA_PAGES_HUGETLB)
+		block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (block == MAP_FAILED){
+		if (pages == ARENA_PAGES_HUGETLB) pages = ARENA_PAGES_THP;
+		block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (block == MAP_FAILED) return -1;
+	}
+
+#if defined(MADV_HUGEPAGE)
+	if (pages == ARENA_PAGES_THP && madvise(block, size, MADV_HUGEPAGE))
+		pages = ARENA_PAGES_NORMAL;
+#else
+	if (pages == ARENA_PAGES_THP) pages = ARENA_PAGES_NORMAL;
+#endif
+
+	arena->raw = block;
+	arena->base = block;
+#else
+	// No huge pages here, only the alignment
+	pages = ARENA_PAGES_NORMAL;
+	arena->raw = malloc(size + ARENA_ALIGN);
+	if (arena->raw == NULL) return -1;
+	arena->base = (uint8_t *)(((uintptr_t)arena->raw + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+#endif
+
+	arena->size = size;
+	arena->pages = pages;
+	return 0;
+}
+
+void arena_free(arena_t *arena){
+	if (arena->raw == NULL) return;
+
+#if defined(__linux__)
+	munmap(arena->raw, arena->size);
+#else
+	free(arena->raw);
+#endif
+	memset(arena, 0, sizeof(arena_t));
+}
@@ -0,0 +1,45 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define ARENA_ALIGN 64                      // Cache line, the widest SIMD load too
+#define ARENA_HUGE_PAGE (2u << 20)
+
+typedef enum{
+	ARENA_PAGES_NORMAL,
+	ARENA_PAGES_THP,                        // Transparent huge pages, advised
+	ARENA_PAGES_HUGETLB,                    // Reserved huge pages
+} arena_pages_t;
+
+// One block mapped at startup, carved with a bump pointer. Everything
+// carved is given back at once by resetting it to a mark.
+typedef struct arena{
+	uint8_t *base;
+	void *raw;                              // Block to give back, base is aligned in it
+	size_t size;
+	size_t used;
+	arena_pages_t pages;                    // Pages it actually got
+} arena_t;
+
+int arena_init(arena_t *arena, size_t size, arena_pages_t pages);
+void arena_free(arena_t *arena);
+
+static inline void *arena_alloc(arena_t *arena, size_t size){
+	// Zeroed and aligned, NULL when the arena is full
+	size_t offset = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (offset + size > arena->size) return NULL;
+
+	arena->used = offset + size;
+	memset(arena->base + offset, 0, size);
+	return arena->base + offset;
+}
+
+static inline void arena_reset(arena_t *arena, size_t mark){
+	arena->used = mark;
+}
+
+#endif
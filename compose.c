@@ -0,0 +1,227 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "compose.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COMPOSE_X86 1
+#else
+#define COMPOSE_X86 0
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define COMPOSE_NEON 1
+#else
+#define COMPOSE_NEON 0
+#endif
+
+// Alpha is the last byte of a Color, the top byte of its pixel
+#define ALPHA_MASK 0xFF000000u
+
+#define PROBE_WIDTH 160                     // A Game Boy row
+#define PROBE_ROWS 256                      // Rows each kernel composes per round
+#define PROBE_ROUNDS 5
+
+/* <== Kernels =================================================> */
+
+void compose_row_scalar(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n){
+	for (int x=0; x<n; x++)
+		out[x] = (over[x] & ALPHA_MASK) ? over[x] : layer[x];
+}
+
+#if COMPOSE_X86
+__attribute__((target("sse2")))
+void compose_row_sse2(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n){
+	// 8 pixels per step, the mask selects the layer where over is transparent
+	const __m128i alpha = _mm_set1_epi32((int)ALPHA_MASK);
+	const __m128i zero = _mm_setzero_si128();
+	int x = 0;
+
+	for (; x + 8 <= n; x += 8){
+		__m128i o0 = _mm_loadu_si128((const __m128i *)&over[x]);
+		__m128i o1 = _mm_loadu_si128((const __m128i *)&over[x + 4]);
+		__m128i l0 = _mm_loadu_si128((const __m128i *)&layer[x]);
+		__m128i l1 = _mm_loadu_si128((const __m128i *)&layer[x + 4]);
+		__m128i m0 = _mm_cmpeq_epi32(_mm_and_si128(o0, alpha), zero);
+		__m128i m1 = _mm_cmpeq_epi32(_mm_and_si128(o1, alpha), zero);
+
+		_mm_storeu_si128((__m128i *)&out[x], 
+			_mm_or_si128(_mm_and_si128(m0, l0), _mm_andnot_si128(m0, o0)));
+		_mm_storeu_si128((__m128i *)&out[x + 4], 
+			_mm_or_si128(_mm_and_si128(m1, l1), _mm_andnot_si128(m1, o1)));
+	}
+
+	compose_row_scalar(&out[x], &over[x], &layer[x], n - x);
+}
+
+__attribute__((target("avx2")))
+void compose_row_avx2(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n){
+	// 16 pixels per step, same select as the SSE2 kernel
+	const __m256i alpha = _mm256_set1_epi32((int)ALPHA_MASK);
+	const __m256i zero = _mm256_setzero_si256();
+	int x = 0;
+
+	for (; x + 16 <= n; x += 16){
+		__m256i o0 = _mm256_loadu_si256((const __m256i *)&over[x]);
+		__m256i o1 = _mm256_loadu_si256((const __m256i *)&over[x + 8]);
+		__m256i l0 = _mm256_loadu_si256((const __m256i *)&layer[x]);
+		__m256i l1 = _mm256_loadu_si256((const __m256i *)&layer[x + 8]);
+		__m256i m0 = _mm256_cmpeq_epi32(_mm256_and_si256(o0, alpha), zero);
+		__m256i m1 = _mm256_cmpeq_epi32(_mm256_and_si256(o1, alpha), zero);
+
+		_mm256_storeu_si256((__m256i *)&out[x], 
+			_mm256_or_si256(_mm256_and_si256(m0, l0), _mm256_andnot_si256(m0, o0)));
+		_mm256_storeu_si256((__m256i *)&out[x + 8], 
+			_mm256_or_si256(_mm256_and_si256(m1, l1), _mm256_andnot_si256(m1, o1)));
+	}
+
+	compose_row_scalar(&out[x], &over[x], &layer[x], n - x);
+}
+#endif
+
+#if COMPOSE_NEON
+void compose_row_neon(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n){
+	// 8 pixels per step, vtst sets the lanes whose alpha is not 0
+	const uint32x4_t alpha = vdupq_n_u32(ALPHA_MASK);
+	int x = 0;
+
+	for (; x + 8 <= n; x += 8){
+		uint32x4_t o0 = vld1q_u32(&over[x]);
+		uint32x4_t o1 = vld1q_u32(&over[x + 4]);
+		uint32x4_t l0 = vld1q_u32(&layer[x]);
+		uint32x4_t l1 = vld1q_u32(&layer[x + 4]);
+
+		vst1q_u32(&out[x], vbslq_u32(vtstq_u32(o0, alpha), o0, l0));
+		vst1q_u32(&out[x + 4], vbslq_u32(vtstq_u32(o1, alpha), o1, l1));
+	}
+
+	compose_row_scalar(&out[x], &over[x], &layer[x], n - x);
+}
+#endif
+
+void compose_row_indexed(uint8_t *out, const uint8_t *over, const uint8_t *layer, int n){
+	int x = 0;
+#if defined(__SSE2__)
+	// 16 pixels per step, SSE2 is part of every x86-64 CPU
+	const __m128i zero = _mm_setzero_si128();
+	for (; x + 16 <= n; x += 16){
+		__m128i o = _mm_loadu_si128((const __m128i *)&over[x]);
+		__m128i l = _mm_loadu_si128((const __m128i *)&layer[x]);
+		__m128i m = _mm_cmpeq_epi8(o, zero);
+		_mm_storeu_si128((__m128i *)&out[x], _mm_or_si128(_mm_and_si128(m, l), o));
+	}
+#elif COMPOSE_NEON
+	for (; x + 16 <= n; x += 16){
+		uint8x16_t o = vld1q_u8(&over[x]);
+		uint8x16_t l = vld1q_u8(&layer[x]);
+		vst1q_u8(&out[x], vbslq_u8(vceqq_u8(o, vdupq_n_u8(0)), l, o));
+	}
+#endif
+	for (; x<n; x++)
+		out[x] = over[x] ? over[x] : layer[x];
+}
+
+/* <== Dispatch ================================================> */
+
+static const compose_impl_t compose_row_impls[] = {
+	{ "scalar", compose_row_scalar },
+#if COMPOSE_X86
+	{ "sse2",   compose_row_sse2   },
+	{ "avx2",   compose_row_avx2   },
+#endif
+#if COMPOSE_NEON
+	{ "neon",   compose_row_neon   },
+#endif
+};
+
+void (*compose_row)(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n) = compose_row_scalar;
+const compose_impl_t *compose_row_impl = &compose_row_impls[0];
+
+static double probe_kernel(const compose_impl_t *impl){
+	// Best of a few rounds composing rows half covered by the layer over
+	// them, the first round also warms the caches
+	static uint32_t over[PROBE_ROWS][PROBE_WIDTH], layer[PROBE_ROWS][PROBE_WIDTH];
+	static uint32_t out[PROBE_WIDTH];
+	double best = 0;
+
+	if (!layer[0][0]){
+		uint32_t r = 0x9E3779B9u;
+		for (int y=0; y<PROBE_ROWS; y++){
+			for (int x=0; x<PROBE_WIDTH; x++){
+				r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+				over[y][x] = (r & 0x100) ? r | ALPHA_MASK : 0;
+				layer[y][x] = r | ALPHA_MASK;
+			}
+		}
+	}
+
+	for (int k=0; k<PROBE_ROUNDS; k++){
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int y=0; y<PROBE_ROWS; y++)
+			impl->compose_row(out, over[y], layer[y], PROBE_WIDTH);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		double ns = (end.tv_sec - start.tv_sec)*1e9 + (end.tv_nsec - start.tv_nsec);
+		if (k == 0 || ns < best) best = ns;
+	}
+
+	return best;
+}
+
+void compose_init(void){
+	// Picked from what the CPU reports, the same kernel on every run.
+	// SSE2 or NEON where there is one. AVX2 wins on some CPUs and loses
+	// on others with rows this short, so it is left to compose_select.
+	const compose_impl_t *impls;
+	int count = compose_impls(&impls);
+	compose_row_impl = &impls[0];
+	for (int i=0; i<count; i++){
+		if (!strcmp(impls[i].name, "sse2") || !strcmp(impls[i].name, "neon"))
+			compose_row_impl = &impls[i];
+	}
+	compose_row = compose_row_impl->compose_row;
+}
+
+int compose_select(const char *name){
+	// Forces a kernel by name, "fastest" times them all and keeps the
+	// fastest one. -1 if this CPU can not run it.
+	const compose_impl_t *impls;
+	int count = compose_impls(&impls);
+	const compose_impl_t *selected = NULL;
+
+	if (!strcmp(name, "fastest")){
+		double best = 0;
+		for (int i=0; i<count; i++){
+			double ns = probe_kernel(&impls[i]);
+			if (selected == NULL || ns < best){
+				best = ns;
+				selected = &impls[i];
+			}
+		}
+	}
+
+	for (int i=0; i<count && selected == NULL; i++){
+		if (!strcmp(impls[i].name, name))
+			selected = &impls[i];
+	}
+
+	if (selected == NULL) return -1;
+	compose_row_impl = selected;
+	compose_row = selected->compose_row;
+	return 0;
+}
+
+int compose_impls(const compose_impl_t **impls){
+	// Returns every kernel this CPU can run, for benchmarking
+	*impls = compose_row_impls;
+	int count = sizeof(compose_row_impls)/sizeof(compose_row_impls[0]);
+#if COMPOSE_X86
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx2")) count--;
+	if (!__builtin_cpu_supports("sse2")) count--;
+#endif
+	return count;
+}
@@ -0,0 +1,32 @@
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#include <stdint.h>
+
+typedef struct compose_impl{
+	const char *name;
+	void (*compose_row)(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n);
+} compose_impl_t;
+
+// Row kernels, out gets over where its alpha is not 0 and layer elsewhere.
+// All of them produce the same pixels.
+void compose_row_scalar(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n);
+#if defined(__x86_64__) || defined(__i386__)
+void compose_row_sse2(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n);
+void compose_row_avx2(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n);
+#endif
+#if defined(__ARM_NEON)
+void compose_row_neon(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n);
+#endif
+
+// Indexed rows, out gets over where its index is not 0 (transparent)
+void compose_row_indexed(uint8_t *out, const uint8_t *over, const uint8_t *layer, int n);
+
+extern void (*compose_row)(uint32_t *out, const uint32_t *over, const uint32_t *layer, int n);
+extern const compose_impl_t *compose_row_impl;
+
+void compose_init(void);
+int compose_select(const char *name);
+int compose_impls(const compose_impl_t **impls);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HANDOFF_SLOTS 3
+#define HANDOFF_FRESH 0x4u                  // Middle slot holds a frame not taken yet
+
+// Lock-free triple buffer between one writer and one reader. Each side
+// owns a slot and the third one is handed over by swapping it, neither
+// side ever waits for the other.
+typedef struct handoff{
+	uint32_t back;                          // Slot the writer fills
+	uint32_t middle;                        // Slot handed over, swapped atomically
+	uint32_t front;                         // Slot the reader draws
+} handoff_t;
+
+static inline void handoff_init(handoff_t *h){
+	h->back = 0;
+	h->middle = 1;
+	h->front = 2;
+}
+
+static inline void handoff_publish(handoff_t *h){
+	// The back slot holds a whole frame, hand it over and fill the old one
+	uint32_t old = __atomic_exchange_n(&h->middle, h->back | HANDOFF_FRESH, __ATOMIC_ACQ_REL);
+	h->back = old & ~HANDOFF_FRESH;
+}
+
+static inline bool handoff_take(handoff_t *h){
+	// Take the newest frame, false if none was published since the last one
+	if (!(__atomic_load_n(&h->middle, __ATOMIC_ACQUIRE) & HANDOFF_FRESH))
+		return false;
+
+	uint32_t old = __atomic_exchange_n(&h->middle, h->front, __ATOMIC_ACQ_REL);
+	h->front = old & ~HANDOFF_FRESH;
+	return true;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#include <raylib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "headless_backend.h"
+
+void headless_init(app_state *app){
+	// No window and no GL context, raylib only writes the dumped frames
+	headless_t *h = &app->headless;
+	h->frames_run = 0;
+
+	if (h->dump != DUMP_NONE && mkdir(h->dump_dir, 0755) && errno != EEXIST)
+		printf("ERROR:%s %s\n", "could not create", h->dump_dir);
+}
+
+static void __dump_rows(const char *path, const uint32_t *pixels){
+	Image img = (Image){
+		(void *)pixels,
+		LCD_WIDTH, LCD_HEIGHT,
+		1,
+		PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+	};
+
+	if (!ExportImage(img, path))
+		printf("ERROR:%s %s\n", "could not write", path);
+}
+
+static const uint32_t *__layer_plane(app_state *app, const frame_t *f, uint32_t z){
+	// The rows of layer z as one plane, NULL if it has none to draw.
+	// Headless frames are published on this thread, without rows the
+	// layers are read right away.
+	static uint32_t plane[LCD_HEIGHT][LCD_WIDTH];
+	layer_rows_t runs[LCD_HEIGHT];
+	uint32_t changed[FB_ROW_WORDS];
+
+	if (f->rows != NULL)
+		return ((f->drawn_layers >> z) & 1) ? f->rows[z*LCD_HEIGHT] : NULL;
+
+	int runs_count = get_layer_rows(app, z, runs, changed);
+	if (runs_count == 0) return NULL;
+
+	for (int r=0; r<runs_count; r++)
+		memcpy(plane[runs[r].y], runs[r].pixels, sizeof(plane[0])*runs[r].count);
+	return plane[0];
+}
+
+void headless_update(app_state *app, const frame_t *f){
+	// The frame is what the window would draw, the lowest layer holds
+	// every layer over it, the whole Game Boy screen. Every frame is
+	// published on the main thread right before this, none is dropped.
+	static const uint32_t transparent[LCD_HEIGHT][LCD_WIDTH];
+	headless_t *h = &app->headless;
+	char path[512];
+	h->frames_run++;
+
+	if (h->dump == DUMP_COMPOSITE){
+		const uint32_t *pixels = __layer_plane(app, f, 0);
+		snprintf(path, sizeof(path), "%s/frame_%06u.png", h->dump_dir, h->frames_run);
+		__dump_rows(path, pixels != NULL ? pixels : transparent[0]);
+	}
+
+	else if (h->dump == DUMP_LAYERS){
+		for (uint32_t i=0; i<f->layers_count; i++){
+			const uint32_t *pixels = __layer_plane(app, f, i);
+			if (pixels == NULL)
+				continue;
+
+			snprintf(path, sizeof(path), "%s/frame_%06u_z%02u.png", h->dump_dir, h->frames_run, f->layer_z[i]);
+			__dump_rows(path, pixels);
+		}
+	}
+}
+
+bool headless_should_close(app_state *app){
+	return app->headless.frames > 0 && app->headless.frames_run >= app->headless.frames;
+}
@@ -0,0 +1,10 @@
+#ifndef HEADLESS_BACKEND_H
+#define HEADLESS_BACKEND_H
+
+#include "main.h"
+
+void headless_init(app_state *app);
+void headless_update(app_state *app, const frame_t *f);
+bool headless_should_close(app_state *app);
+
+#endif
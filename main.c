@@ -8,7 +8,15 @@
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include <unistd.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -17,6 +25,9 @@
 #include "lcd.h"
 #include "raylib_backend.h"
 #include "meta.h"
+#include "fingerprint.h"
+#include "compose.h"
+#include "workers.h"
 
 // I don't know exactly what to do with this
 // later i will determine
@@ -26,26 +37,250 @@ float planes_distance = 0.2f;
 
 /* <== Utils ===================================================> */
 
-void sample_vram_tiles(gb_s *gb, tile_t *tiles){
-	for (int i=0; i<VRAM_TILE_COUNT; i++){
-		tiles[i].raw_data = &gb->vram[TILE_SIZE*i];
-		tiles[i].hash = ComputeCRC32(
-			tiles[i].raw_data, 
-			TILE_SIZE
+uint32_t get_tile_hash(gb_s *gb, uint16_t tile_i){
+	// Re-hash the tile only if it was written since the last time
+	uint32_t *dirty = &gb->display.tiles_dirty[tile_i >> 5];
+	uint32_t bit = (uint32_t)1 << (tile_i & 31);
+	tile_t *t = &tiles_on_vram[tile_i];
+	
+	if (*dirty & bit){
+		*dirty &= ~bit;
+		t->raw_data = &gb->vram[TILE_SIZE*tile_i];
+		t->hash = fingerprint_crc32(t->raw_data, TILE_SIZE);
+		t->meta_valid = false;
+	}
+
+	return t->hash;
+}
+
+meta_t *resolve_tile_meta(app_state *app, uint16_t tile_i){
+	tile_t *t = &tiles_on_vram[tile_i];
+	t->meta = get_meta(&app->meta, get_tile_hash(&app->gb, tile_i));
+	t->meta_generation = app->meta.generation;
+	t->meta_valid = true;
+	return t->meta;
+}
+
+void sample_vram_tiles(gb_s *gb){
+	// Consume all pending dirty tiles, so the inspector is up to date
+	for (int i=0; i<VRAM_TILE_COUNT/32; i++){
+		if (gb->display.tiles_dirty[i] == 0) continue;
+		for (int o=0; o<32; o++)
+			get_tile_hash(gb, i*32 + o);
+	}
+}
+
+static uint64_t composed_rows = 0;       // Rows written by compose, for benchmarks
+static uint64_t cleared_rows = 0;        // Layer rows cleared, for benchmarks
+
+static double elapsed_ns(struct timespec *start){
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec)*1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+void bench_tile_hashes(gb_s *gb, int iterations){
+	// Hashes the tiles currently on VRAM with every fingerprint implementation
+	const fingerprint_impl_t *impls;
+	int impls_q = fingerprint_impls(&impls);
+	volatile uint64_t sink = 0;
+	struct timespec start;
+
+	for (int i=0; i<impls_q; i++){
+		int mismatches = 0;
+		for (int t=0; t<VRAM_TILE_COUNT; t++){
+			if (impls[i].crc32(&gb->vram[TILE_SIZE*t], TILE_SIZE) != get_tile_hash(gb, t))
+				mismatches++;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int n=0; n<iterations; n++){
+			for (int t=0; t<VRAM_TILE_COUNT; t++)
+				sink += impls[i].crc32(&gb->vram[TILE_SIZE*t], TILE_SIZE);
+		}
+
+		printf("%-10s %6.2f ns/tile, %d mismatches\n", impls[i].name, 
+			elapsed_ns(&start) / ((double)iterations*VRAM_TILE_COUNT), mismatches
 		);
 	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int n=0; n<iterations; n++){
+		for (int t=0; t<VRAM_TILE_COUNT; t++)
+			sink += fingerprint_fp64(&gb->vram[TILE_SIZE*t], TILE_SIZE);
+	}
+
+	printf("%-10s %6.2f ns/tile\n", "fp64", 
+		elapsed_ns(&start) / ((double)iterations*VRAM_TILE_COUNT)
+	);
+}
+
+void bench_lcd(app_state *app, int frames){
+	// Re-renders every line of the current frame, timing only the renderer
+	gb_s *gb = &app->gb;
+	uint8_t ly = gb->hram_io[IO_LY];
+	uint8_t window_clear = gb->display.window_clear;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int n=0; n<frames; n++){
+		gb->display.window_clear = 0;
+		for (int y=0; y<LCD_HEIGHT; y++){
+			gb->hram_io[IO_LY] = y;
+			lcd_render_line(gb);
+		}
+	}
+
+	printf("lcd_render_line %8.2f ns/line\n", 
+		elapsed_ns(&start) / ((double)frames*LCD_HEIGHT)
+	);
+
+	gb->hram_io[IO_LY] = ly;
+	gb->display.window_clear = window_clear;
+}
+
+static inline uint64_t read_cycles(void){
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+void bench_compose(app_state *app, int iterations){
+	// Composes the two lowest layers with every kernel, checking them
+	// against the scalar one
+	const compose_impl_t *impls;
+	int impls_q = compose_impls(&impls);
+	if (app->layers == NULL || app->layers_count < 2){
+		printf("ERROR:%s\n", "no layers to compose");
+		return;
+	}
+
+	uint32_t *over = &app->layers[1].pixels[0][0];
+	uint32_t *layer = &app->layers[0].pixels[0][0];
+	const int n = LCD_WIDTH*LCD_HEIGHT;
+	struct timespec start;
+
+	uint32_t *expected = malloc(n * sizeof(uint32_t));
+	uint32_t *out = malloc(n * sizeof(uint32_t));
+	compose_row_scalar(expected, over, layer, n);
+
+	for (int i=0; i<impls_q; i++){
+		impls[i].compose_row(out, over, layer, n);
+		int mismatches = 0;
+		for (int p=0; p<n; p++)
+			mismatches += out[p] != expected[p];
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		uint64_t cycles = read_cycles();
+		for (int k=0; k<iterations; k++){
+			for (int y=0; y<LCD_HEIGHT; y++)
+				impls[i].compose_row(&out[y*LCD_WIDTH], &over[y*LCD_WIDTH], &layer[y*LCD_WIDTH], LCD_WIDTH);
+		}
+		cycles = read_cycles() - cycles;
+		double ns = elapsed_ns(&start);
+
+		printf("%-8s %6.2f px/ns, %6.2f px/cycle, %d mismatches%s\n", impls[i].name, 
+			(double)n*iterations / ns, 
+			cycles ? (double)n*iterations / cycles : 0.0, 
+			mismatches, &impls[i] == compose_row_impl ? " (selected)" : ""
+		);
+	}
+
+	free(expected);
+	free(out);
+}
+
+static int open_cache_misses(void){
+	// Counter of the cache misses of this thread, -1 if not available
+#if defined(__linux__)
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static void count_cache_misses(int fd, bool enable){
+#if defined(__linux__)
+	if (fd >= 0) ioctl(fd, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+#endif
+}
+
+static const char *read_cache_misses(int fd, int frames, char *buf, size_t len){
+	// Misses per frame as text, n/a when the kernel gives no counters
+	uint64_t misses = 0;
+	if (fd < 0 || read(fd, &misses, sizeof(misses)) != sizeof(misses))
+		return "n/a";
+
+	close(fd);
+	snprintf(buf, len, "%.0f", (double)misses / frames);
+	return buf;
+}
+
+void bench_frames(app_state *app, int frames){
+	// Runs frames back to back, timing emulation with line rendering
+	// and composition apart. Advances the emulation.
+	uint64_t rows = composed_rows, cleared = cleared_rows;
+	size_t px_size = app->render_target == RENDER_TARGET_INDEXED ? sizeof(uint8_t) : sizeof(uint32_t);
+	double emulate_ns = 0, compose_ns = 0;
+	int emulate_misses = open_cache_misses(), compose_misses = open_cache_misses();
+	char misses_buf[2][32];
+	struct timespec start;
+
+	for (int n=0; n<frames; n++){
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		count_cache_misses(emulate_misses, true);
+		gb_run_frame(&app->gb);
+		lcd_finish_frame(app);
+		count_cache_misses(emulate_misses, false);
+		emulate_ns += elapsed_ns(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		count_cache_misses(compose_misses, true);
+		compose_all_framebuffers(app);
+		count_cache_misses(compose_misses, false);
+		compose_ns += elapsed_ns(&start);
+	}
+
+	rows = composed_rows - rows;
+	cleared = cleared_rows - cleared;
+	printf("emulate+render %8.2f us/frame, %7.1f KB/frame cleared, %8s cache misses/frame%s\n", 
+		emulate_ns / (1000.0*frames), 
+		cleared * px_size * LCD_WIDTH / (1024.0*frames), 
+		read_cache_misses(emulate_misses, frames, misses_buf[0], sizeof(misses_buf[0])), 
+		app->fused_compose ? " (fused compose)" : ""
+	);
+	printf("compose        %8.2f us/frame, %7.1f KB/frame written (%.1f rows), %8s cache misses/frame, %d threads\n", 
+		compose_ns / (1000.0*frames), 
+		rows * px_size * LCD_WIDTH / (1024.0*frames), 
+		(double)rows / frames, 
+		read_cache_misses(compose_misses, frames, misses_buf[1], sizeof(misses_buf[1])), 
+		app->compose_workers.count
+	);
 }
 
 void handle_input(app_state *app){
-	app->gb.direct.joypad = 255; //clean joypad state
-	if (IsKeyDown(KEY_RIGHT))     app->gb.direct.joypad &= ~JOYPAD_RIGHT;
-	if (IsKeyDown(KEY_LEFT))      app->gb.direct.joypad &= ~JOYPAD_LEFT;
-	if (IsKeyDown(KEY_UP))        app->gb.direct.joypad &= ~JOYPAD_UP;
-	if (IsKeyDown(KEY_DOWN))      app->gb.direct.joypad &= ~JOYPAD_DOWN;
-	if (IsKeyDown(KEY_Z))         app->gb.direct.joypad &= ~JOYPAD_A;
-	if (IsKeyDown(KEY_X))         app->gb.direct.joypad &= ~JOYPAD_B;
-	if (IsKeyDown(KEY_P))         app->gb.direct.joypad &= ~JOYPAD_START;
-	if (IsKeyDown(KEY_BACKSPACE)) app->gb.direct.joypad &= ~JOYPAD_SELECT;
+	// Keys are stored in one word, the emulation loads it before every
+	// frame from whichever thread runs it
+	uint8_t joypad = 255; //clean joypad state
+	if (IsKeyDown(KEY_RIGHT))     joypad &= ~JOYPAD_RIGHT;
+	if (IsKeyDown(KEY_LEFT))      joypad &= ~JOYPAD_LEFT;
+	if (IsKeyDown(KEY_UP))        joypad &= ~JOYPAD_UP;
+	if (IsKeyDown(KEY_DOWN))      joypad &= ~JOYPAD_DOWN;
+	if (IsKeyDown(KEY_Z))         joypad &= ~JOYPAD_A;
+	if (IsKeyDown(KEY_X))         joypad &= ~JOYPAD_B;
+	if (IsKeyDown(KEY_P))         joypad &= ~JOYPAD_START;
+	if (IsKeyDown(KEY_BACKSPACE)) joypad &= ~JOYPAD_SELECT;
+	__atomic_store_n(&app->joypad, joypad, __ATOMIC_RELAXED);
 }
 
 void exec_cmd(app_state *app, int argc, char **argv){
@@ -272,7 +507,7 @@ void exec_cmd(app_state *app, int argc, char **argv){
 			return;
 		}
 
-		save_meta(argv[1], app->meta);
+		save_meta(argv[1], &app->meta);
 	}
 
 	// LOAD META COMMAND
@@ -285,51 +520,855 @@ void exec_cmd(app_state *app, int argc, char **argv){
 		load_meta(argv[1], &app->meta);
 	}
 
+	// BENCH HASH COMMAND
+	else if (!strcmp(argv[0], "bench_hash")){
+		if (argc > 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		int iterations = argc == 2 ? atoi(argv[1]) : 1000;
+		bench_tile_hashes(&app->gb, iterations);
+	}
+
+	// BENCH LCD COMMAND
+	else if (!strcmp(argv[0], "bench_lcd")){
+		if (argc > 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		int frames = argc == 2 ? atoi(argv[1]) : 100;
+		bench_lcd(app, frames);
+	}
+
+	// BENCH FRAMES COMMAND
+	else if (!strcmp(argv[0], "bench_frames")){
+		if (argc > 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		int frames = argc == 2 ? atoi(argv[1]) : 600;
+		bench_frames(app, frames);
+	}
+
+	// BENCH COMPOSE COMMAND
+	else if (!strcmp(argv[0], "bench_compose")){
+		if (argc > 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		int iterations = argc == 2 ? atoi(argv[1]) : 1000;
+		bench_compose(app, iterations);
+	}
+
+	// COMPOSE KERNEL COMMAND
+	else if (!strcmp(argv[0], "compose_kernel")){
+		if (argc != 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		if (strcmp(argv[1], "status") && compose_select(argv[1])){
+			printf("ERROR:%s\n", "kernel not available on this CPU");
+			return;
+		}
+		printf("compose kernel: %s\n", compose_row_impl->name);
+	}
+
+	// INCREMENTAL RENDERING COMMAND
+	else if (!strcmp(argv[0], "incremental")){
+		if (argc != 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		if (!strcmp(argv[1], "on"))
+			lcd_set_incremental(true, false);
+		else if (!strcmp(argv[1], "off"))
+			lcd_set_incremental(false, false);
+		else if (!strcmp(argv[1], "verify"))
+			lcd_set_incremental(true, true);
+		else if (!strcmp(argv[1], "status"))
+			printf("verify failures: %u\n", lcd_verify_failures());
+		else
+			printf("ERROR:%s\n", "bad format");
+	}
+
+	// FUSED COMPOSE COMMAND
+	else if (!strcmp(argv[0], "fused_compose")){
+		if (argc != 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		if (!strcmp(argv[1], "on"))
+			app->fused_compose = true;
+		else if (!strcmp(argv[1], "off"))
+			app->fused_compose = false;
+		else
+			printf("ERROR:%s\n", "bad format");
+	}
+
+	// RENDER TARGET COMMAND
+	else if (!strcmp(argv[0], "render_target")){
+		if (argc != 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		if (!strcmp(argv[1], "layers"))
+			set_render_target(app, RENDER_TARGET_LAYERS);
+		else if (!strcmp(argv[1], "abuffer"))
+			set_render_target(app, RENDER_TARGET_ABUFFER);
+		else if (!strcmp(argv[1], "indexed"))
+			set_render_target(app, RENDER_TARGET_INDEXED);
+		else if (!strcmp(argv[1], "status") && app->abuffer != NULL)
+			printf("abuffer %zu KB, %" PRIu64 " fragments dropped\n", 
+				app->arena.used / 1024, app->abuffer->overflows
+			);
+		else if (!strcmp(argv[1], "status") && app->layers8 != NULL)
+			printf("indexed %zu KB, %u layers, %d colors\n", 
+				app->arena.used / 1024, app->layers_count, app->palette.count - 1
+			);
+		else if (!strcmp(argv[1], "status"))
+			printf("layers %zu KB, %u layers%s\n", 
+				app->arena.used / 1024, app->layers_count, 
+				app->indexed_fallback ? " (indexed fell back, too many colors)" : ""
+			);
+		else
+			printf("ERROR:%s\n", "bad format");
+	}
+
+	// ARENA COMMAND
+	else if (!strcmp(argv[0], "arena")){
+		static const char *pages_names[] = {"normal", "thp", "hugetlb"};
+		if (argc != 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		if (!strcmp(argv[1], "status")){
+			printf("arena %zu/%zu KB used, %s pages\n", 
+				app->arena.used / 1024, app->arena.size / 1024, pages_names[app->arena.pages]
+			);
+			return;
+		}
+
+		int pages = 0;
+		while (pages < 3 && strcmp(argv[1], pages_names[pages])) pages++;
+		if (pages == 3){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		if (set_arena_pages(app, (arena_pages_t)pages)){
+			printf("ERROR:%s, kept on %s pages\n", "render buffers could not be mapped", pages_names[app->arena.pages]);
+			return;
+		}
+		printf("arena on %s pages\n", pages_names[app->arena.pages]);
+	}
+
+	// COMPOSE THREADS COMMAND
+	else if (!strcmp(argv[0], "compose_threads")){
+		if (argc != 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		int threads = atoi(argv[1]);
+		if (threads < 1 || threads > WORKERS_MAX){
+			printf("ERROR:%s\n", "threads out of range");
+			return;
+		}
+
+		workers_stop(&app->compose_workers);
+		printf("%d compose threads\n", workers_start(&app->compose_workers, threads));
+	}
+
+	// EMULATION THREAD COMMAND
+	else if (!strcmp(argv[0], "emulation_thread")){
+		if (argc != 2){
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+
+		if (!strcmp(argv[1], "status")){
+			// Frame rate since the last status
+			static uint32_t last_frames;
+			static struct timespec last;
+			uint32_t frames = __atomic_load_n(&app->emulation.frames, __ATOMIC_RELAXED);
+			double ns = last.tv_sec ? elapsed_ns(&last) : 0;
+
+			printf("emulation thread %s, %.2f frames/s (%.2f Hz target)\n", 
+				app->emulation.running ? "on" : "off", 
+				ns > 0 ? (frames - last_frames) * 1e9 / ns : 0.0, 
+				VERTICAL_SYNC
+			);
+			last_frames = frames;
+			clock_gettime(CLOCK_MONOTONIC, &last);
+			return;
+		}
+
+		if (!strcmp(argv[1], "on")){
+			// Headless frames are counted and dumped as they are drawn,
+			// a paced thread would drop the ones not taken in time
+			if (app->headless.enabled){
+				printf("ERROR:%s\n", "headless runs keep every frame on the main thread");
+				return;
+			}
+			if (start_emulation_thread(app)){
+				printf("ERROR:%s\n", "emulation thread could not be started");
+				return;
+			}
+		}
+		else if (!strcmp(argv[1], "off")) stop_emulation_thread(app);
+		else{
+			printf("ERROR:%s\n", "bad format");
+			return;
+		}
+		carve_frames(app);
+		printf("emulation thread %s\n", app->emulation.running ? "on" : "off");
+	}
+
 }
 
+static const uint32_t all_rows[FB_ROW_WORDS] = {
+	[0 ... FB_ROW_WORDS - 2] = ~0u, 
+	[FB_ROW_WORDS - 1] = ~0u >> (32*FB_ROW_WORDS - LCD_HEIGHT)
+};
+
 void reset_framebuffers(app_state *app){
 	memset( &app->framebuffers[0], 
-		0, sizeof(framebuffer_t)*Z_LAYERS
+		0, sizeof(framebuffer_t)*app->layers_count
 	);
+	memset( &app->layers[0], 
+		0, sizeof(framebuffer_t)*app->layers_count
+	);
+	memset(app->line_layers, 0, sizeof(app->line_layers));
+	app->used_layers = 0;
 }
 
-void draw_to_framebuffer(app_state *app, uint32_t z, int x, int y, Color color){
-	// Copy color to the framebuffer
-	framebuffer_t *fb = &app->framebuffers[z];
-	fb->used_flag = true;
-	memcpy(&fb->pixels[y][x], &color, sizeof(uint32_t));
-	return;
+static void repaint_lines(app_state *app, const uint64_t *line_layers){
+	// Paint the decoded lines again, only the ones that are on screen
+	for (int y=0; y<LCD_HEIGHT; y++){
+		if (line_layers[y])
+			lcd_paint_line(app, lcd_get_scanline(y), y);
+	}
+}
+
+static void *carve_render_buffer(app_state *app, size_t size){
+	// The arena is sized for the largest layout, running out of it means
+	// render_buffers_size is wrong
+	void *buffer = arena_alloc(&app->arena, size);
+	if (buffer == NULL){
+		fprintf(stderr, "%d: %s\n", __LINE__, "render buffers do not fit in the arena");
+		abort();
+	}
+	return buffer;
+}
+
+void carve_frames(app_state *app){
+	// Frames handed over to the emulation thread keep their own copy of
+	// every layer, filled again whole. Carved last, only while the thread
+	// runs, on the main thread the renderer reads the layers directly.
+	arena_reset(&app->arena, app->frames_mark);
+	for (int k=0; k<HANDOFF_SLOTS; k++){
+		app->frames[k].rows = NULL;
+		if (app->emulation.running)
+			app->frames[k].rows = carve_render_buffer(app, sizeof(uint32_t)*LCD_WIDTH*LCD_HEIGHT*app->layers_count);
+		memset(app->frames[k].layer_frames, 0, sizeof(app->frames[k].layer_frames));
+	}
+}
+
+void set_render_target(app_state *app, render_target_t target){
+	// Swap the buffers the lines are painted on, the lines already
+	// decoded are painted again on the new ones
+	uint64_t line_layers[LCD_HEIGHT];
+	memcpy(line_layers, app->line_layers, sizeof(line_layers));
+
+	arena_reset(&app->arena, 0);
+	app->framebuffers = app->layers = NULL;
+	app->framebuffers8 = app->layers8 = NULL;
+	app->abuffer = NULL;
+	app->resolved = NULL;
+	app->render_target = target;
+	app->indexed_fallback = false;
+	app->layers_count = app->meta.layers_count;
+	app->layers_generation = app->meta.layers_generation;
+	memset(app->line_layers, 0, sizeof(app->line_layers));
+	memset(app->line_cleared, 0, sizeof(app->line_cleared));
+	memset(app->fused_rows, 0, sizeof(app->fused_rows));
+	app->used_layers = 0;
+
+	switch (target){
+	case RENDER_TARGET_ABUFFER:
+		app->abuffer = carve_render_buffer(app, sizeof(abuffer_t));
+		app->resolved = carve_render_buffer(app, sizeof(uint32_t)*LCD_WIDTH*LCD_HEIGHT);
+		break;
+
+	case RENDER_TARGET_INDEXED:
+		app->framebuffers8 = carve_render_buffer(app, sizeof(framebuffer8_t)*app->layers_count);
+		app->layers8 = carve_render_buffer(app, sizeof(framebuffer8_t)*app->layers_count);
+		app->resolved = carve_render_buffer(app, sizeof(uint32_t)*LCD_WIDTH*LCD_HEIGHT);
+		palette_reset(&app->palette, app->meta.generation);
+		break;
+
+	default:
+		app->framebuffers = carve_render_buffer(app, sizeof(framebuffer_t)*app->layers_count);
+		app->layers = carve_render_buffer(app, sizeof(framebuffer_t)*app->layers_count);
+		reset_framebuffers(app);
+		break;
+	}
+
+	app->frames_mark = app->arena.used;
+	carve_frames(app);
+
+	// Planes drawn for the old buffers are uploaded again whole
+	for (uint32_t i=0; i<app->layers_count; i++){
+		if (app->framebuffers != NULL)
+			memcpy(app->framebuffers[i].dirty_rows, all_rows, sizeof(all_rows));
+		if (app->framebuffers8 != NULL)
+			memcpy(app->framebuffers8[i].dirty_rows, all_rows, sizeof(all_rows));
+	}
+
+	repaint_lines(app, line_layers);
+}
+
+static size_t render_buffers_size(void){
+	// The largest render target and the frames handed over while the
+	// emulation thread runs, with every depth a profile can use. Only
+	// what is carved gets touched.
+	size_t plane = sizeof(uint32_t)*LCD_WIDTH*LCD_HEIGHT;
+	size_t frames = HANDOFF_SLOTS*(plane*Z_LAYERS + ARENA_ALIGN);
+	size_t size = 2*sizeof(framebuffer_t)*Z_LAYERS;
+	if (2*sizeof(framebuffer8_t)*Z_LAYERS + plane > size)
+		size = 2*sizeof(framebuffer8_t)*Z_LAYERS + plane;
+	if (sizeof(abuffer_t) + plane > size)
+		size = sizeof(abuffer_t) + plane;
+
+	return frames + size + 3*ARENA_ALIGN;
+}
+
+int set_arena_pages(app_state *app, arena_pages_t pages){
+	// Map a new arena, with normal pages if that fails, and only then
+	// swap it in and carve the render target from it. Returns 0 on
+	// success, the old arena and its buffers are kept otherwise.
+	arena_t arena;
+	if (arena_init(&arena, render_buffers_size(), pages) && 
+		arena_init(&arena, render_buffers_size(), ARENA_PAGES_NORMAL))
+		return -1;
+
+	arena_free(&app->arena);
+	app->arena = arena;
+	set_render_target(app, app->render_target);
+	return 0;
+}
+
+void sync_layers(app_state *app){
+	// The metas changed the depths in use, lay out their layers again,
+	// indexed again if it only fell back for this layout
+	if (app->layers_generation != app->meta.layers_generation)
+		set_render_target(app, app->indexed_fallback ? RENDER_TARGET_INDEXED : app->render_target);
+}
+
+static inline void mark_framebuffer_row(uint32_t *dirty_rows, int y){
+	dirty_rows[y >> 5] |= (uint32_t)1 << (y & 31);
+}
+
+static inline uint32_t *get_layer_row(app_state *app, framebuffer_t *fb, int y){
+	// A row stamped before the line was cleared is only zeroed once it
+	// gets painted again
+	if (fb->row_stamps[y] != app->line_generations[y]){
+		memset(fb->pixels[y], 0, sizeof(fb->pixels[y]));
+		fb->row_stamps[y] = app->line_generations[y];
+		cleared_rows++;
+	}
+
+	return fb->pixels[y];
+}
+
+static inline const uint32_t *read_layer_row(const uint32_t *generations, const framebuffer_t *fb, int y){
+	static const uint32_t transparent_row[LCD_WIDTH];
+	return fb->row_stamps[y] == generations[y] ? fb->pixels[y] : transparent_row;
 }
 
-void compose_framebuffers(framebuffer_t *over, framebuffer_t *behind){
-	if (!behind->used_flag){
-		if (over->copy != NULL)
-			behind->copy = over->copy;
-		else behind->copy = over;
+void clear_framebuffer_line(app_state *app, int y){
+	// Clear a line on every layer it was painted on
+	uint64_t layers = app->line_layers[y];
+	app->line_layers[y] = 0;
+	app->line_cleared[y] |= layers;
+
+	if (app->render_target == RENDER_TARGET_ABUFFER){
+		if (layers) abuffer_clear_row(app->abuffer, y);
+		return;
+	}
+
+	// Full color layers are cleared all at once by a new generation
+	if (app->render_target == RENDER_TARGET_LAYERS)
+		app->line_generations[y]++;
+
+	while (layers){
+		int z = __builtin_ctzll(layers);
+		layers &= layers - 1;
+
+		if (app->render_target == RENDER_TARGET_INDEXED){
+			memset(app->layers8[z].pixels[y], 0, sizeof(app->layers8[z].pixels[y]));
+			mark_framebuffer_row(app->layers8[z].dirty_rows, y);
+			cleared_rows++;
+			continue;
+		}
+
+		mark_framebuffer_row(app->layers[z].dirty_rows, y);
+	}
+}
+
+void fill_framebuffer_span(app_state *app, uint32_t z, int x, int y, int len, Color color){
+	// Fill a run of pixels on one line with a constant color
+	uint32_t c;
+	memcpy(&c, &color, sizeof(uint32_t));
+	app->line_layers[y] |= (uint64_t)1 << z;
+
+	switch (app->render_target){
+	case RENDER_TARGET_ABUFFER:
+		abuffer_fill_span(app->abuffer, z, x, y, len, c);
+		return;
+
+	case RENDER_TARGET_INDEXED:
+		mark_framebuffer_row(app->layers8[z].dirty_rows, y);
+		memset(&app->layers8[z].pixels[y][x], palette_index(&app->palette, c), len);
+		return;
+
+	default:
+		break;
+	}
+
+	framebuffer_t *fb = &app->layers[z];
+	uint32_t *row = get_layer_row(app, fb, y) + x;
+	mark_framebuffer_row(fb->dirty_rows, y);
+	for (int i=0; i<len; i++)
+		row[i] = c;
+}
+
+void write_framebuffer_span(app_state *app, uint32_t z, int x, int y, int len, const Color *colors){
+	// Copy a run of colors, usually a tile row, to one line
+	const uint32_t *c = (const uint32_t *)colors;
+	app->line_layers[y] |= (uint64_t)1 << z;
+
+	switch (app->render_target){
+	case RENDER_TARGET_ABUFFER:
+		abuffer_write_span(app->abuffer, z, x, y, len, c);
+		return;
+
+	case RENDER_TARGET_INDEXED:{
+		// Tile rows have at most 4 colors, only look up changes
+		uint8_t *row = &app->layers8[z].pixels[y][x];
+		uint32_t last = c[0];
+		uint8_t index = palette_index(&app->palette, last);
+		mark_framebuffer_row(app->layers8[z].dirty_rows, y);
+		for (int i=0; i<len; i++){
+			if (c[i] != last){
+				last = c[i];
+				index = palette_index(&app->palette, last);
+			}
+			row[i] = index;
+		}
 		return;
 	}
 
-	if (over->copy != NULL)
+	default:
+		break;
+	}
+
+	framebuffer_t *fb = &app->layers[z];
+	mark_framebuffer_row(fb->dirty_rows, y);
+	memcpy(get_layer_row(app, fb, y) + x, colors, len * sizeof(uint32_t));
+}
+
+static int compose_framebuffers(app_state *app, int z, const uint32_t *rows){
+	// Frame buffer z gets its layer with the opaque pixels of the layers
+	// over it, only on the given rows. Layer rows of old generations are
+	// transparent. Returns the rows composed.
+	framebuffer_t *out = &app->framebuffers[z];
+	framebuffer_t *layer = &app->layers[z];
+	framebuffer_t *over = z < (int)app->layers_count - 1 ? &app->framebuffers[z + 1] : NULL;
+	int count = 0;
+
+	for (int w=0; w<FB_ROW_WORDS; w++){
+		uint32_t bits = rows[w];
+
+		while (bits){
+			int y = w * 32 + __builtin_ctz(bits);
+			bits &= bits - 1;
+			count++;
+
+			const uint32_t *layer_row = read_layer_row(app->line_generations, layer, y);
+			if (over == NULL){
+				memcpy(out->pixels[y], layer_row, sizeof(out->pixels[y]));
+				continue;
+			}
+
+			compose_row(out->pixels[y], app->framebuffers[over->row_owners[y]].pixels[y], layer_row, LCD_WIDTH);
+		}
+	}
+
+	return count;
+}
+
+static int compose_framebuffers8(framebuffer8_t *over, framebuffer8_t *layer, framebuffer8_t *out, const uint32_t *rows){
+	// Same as compose_framebuffers, index 0 is transparent
+	int count = 0;
+	if (over != NULL && over->copy != NULL)
 		over = over->copy;
 
-	for (int y=0; y<LCD_HEIGHT; y++){
-		for (int x=0; x<LCD_WIDTH; x++){
-			Color over_pixel_color;
-			memcpy(&over_pixel_color, &over->pixels[y][x], sizeof(Color));
-			if (over_pixel_color.a == 0) continue;
-			behind->pixels[y][x] = over->pixels[y][x];
+	for (int w=0; w<FB_ROW_WORDS; w++){
+		uint32_t bits = rows[w];
+
+		while (bits){
+			int y = w * 32 + __builtin_ctz(bits);
+			bits &= bits - 1;
+			count++;
+
+			if (over == NULL){
+				memcpy(out->pixels[y], layer->pixels[y], sizeof(out->pixels[y]));
+				continue;
+			}
+
+			compose_row_indexed(out->pixels[y], over->pixels[y], layer->pixels[y], LCD_WIDTH);
+		}
+	}
+
+	return count;
+}
+
+void compose_framebuffer_line(app_state *app, int y){
+	// Fused compose, the line is composed right after being painted while
+	// its layer rows are still in cache. It goes by the layers used on the
+	// last frame, compose_all_framebuffers only keeps the rows if those
+	// did not change.
+	uint64_t changed = app->line_layers[y] | app->line_cleared[y];
+	app->line_cleared[y] = 0;
+	if (!app->fused_compose || app->render_target != RENDER_TARGET_LAYERS || !changed)
+		return;
+
+	// Layers over the highest one changed keep their rows, the row over
+	// it is wherever the last compose left it
+	int top = 63 - __builtin_clzll(changed);
+	const uint32_t *over_row = NULL;
+	if (top < (int)app->layers_count - 1)
+		over_row = app->framebuffers[app->framebuffers[top + 1].row_owners[y]].pixels[y];
+
+	for (int i = top; i >= 0; i--){
+		framebuffer_t *fb = &app->framebuffers[i];
+		if (!fb->used_flag)
+			continue;
+
+		const uint32_t *layer_row = read_layer_row(app->line_generations, &app->layers[i], y);
+		if (over_row == NULL)
+			memcpy(fb->pixels[y], layer_row, sizeof(fb->pixels[y]));
+		else
+			compose_row(fb->pixels[y], over_row, layer_row, LCD_WIDTH);
+		over_row = fb->pixels[y];
+		composed_rows++;
+	}
+
+	app->fused_rows[y >> 5] |= (uint32_t)1 << (y & 31);
+}
+
+static void rebuild_palette(app_state *app){
+	// Build the palette again from the lines on screen, dropping the
+	// colors that are not painted anymore
+	uint64_t line_layers[LCD_HEIGHT];
+	memcpy(line_layers, app->line_layers, sizeof(line_layers));
+
+	for (int y=0; y<LCD_HEIGHT; y++)
+		clear_framebuffer_line(app, y);
+	palette_reset(&app->palette, app->meta.generation);
+	repaint_lines(app, line_layers);
+
+	// Still full, the colors on screen do not fit in the indices. Paint
+	// full color layers until the layout changes, lines are never left
+	// with pixels that went transparent.
+	if (app->palette.full){
+		printf("WARNING: more than %d colors on screen, layers target until the layout changes\n", PALETTE_SIZE - 1);
+		set_render_target(app, RENDER_TARGET_LAYERS);
+		app->indexed_fallback = true;
+	}
+}
+
+static void compose_band(void *arg, int band, int bands){
+	// Rows only depend on the same row of the layers over them, each band
+	// of rows goes from front to back on its own
+	app_state *app = arg;
+	uint32_t band_rows[FB_ROW_WORDS] = {0}, rows[FB_ROW_WORDS];
+	int count = 0;
+
+	for (int y = band*LCD_HEIGHT / bands; y < (band + 1)*LCD_HEIGHT / bands; y++)
+		band_rows[y >> 5] |= (uint32_t)1 << (y & 31);
+
+	for (int i = app->layers_count - 1; i >= 0; i--){
+		bool any = false;
+		for (int w=0; w<FB_ROW_WORDS; w++){
+			rows[w] = app->compose_rows[i][w] & band_rows[w];
+			any |= rows[w] != 0;
+		}
+		if (!any) continue;
+
+		bool top = i == (int)app->layers_count - 1;
+		if (app->render_target == RENDER_TARGET_INDEXED)
+			count += compose_framebuffers8(top ? NULL : &app->framebuffers8[i + 1], &app->layers8[i], &app->framebuffers8[i], rows);
+		else
+			count += compose_framebuffers(app, i, rows);
+	}
+
+	__atomic_fetch_add(&composed_rows, count, __ATOMIC_RELAXED);
+}
+
+static void plan_indexed_framebuffers(app_state *app, uint64_t used){
+	// Same as the full color layers, on one byte per pixel
+	uint32_t dirty[FB_ROW_WORDS] = {0};
+
+	for (int i = app->layers_count - 1; i >= 0; i--){
+		framebuffer8_t *fb = &app->framebuffers8[i];
+		framebuffer8_t *layer = &app->layers8[i];
+		framebuffer8_t *over = i < (int)app->layers_count - 1 ? &app->framebuffers8[i + 1] : NULL;
+		bool was_used = fb->used_flag;
+
+		for (int w=0; w<FB_ROW_WORDS; w++){
+			dirty[w] |= layer->dirty_rows[w];
+			layer->dirty_rows[w] = 0;
+		}
+
+		fb->used_flag = (used >> i) & 1;
+		fb->copy = NULL;
+		memset(app->compose_rows[i], 0, sizeof(app->compose_rows[i]));
+		for (int w=0; w<FB_ROW_WORDS; w++)
+			fb->dirty_rows[w] |= dirty[w];
+
+		if (fb->used_flag){
+			memcpy(app->compose_rows[i], was_used ? dirty : all_rows, sizeof(app->compose_rows[i]));
+		}
+		else if (over != NULL){
+			fb->copy = over->copy != NULL ? over->copy : over;
+		}
+		else if (was_used){
+			memset(fb->pixels, 0, sizeof(fb->pixels));
+			memcpy(fb->dirty_rows, all_rows, sizeof(fb->dirty_rows));
 		}
 	}
 }
 
 void compose_all_framebuffers(app_state *app){
+	// Painted layers are kept between frames, compose them into the
+	// framebuffers without touching them. Only rows changed on a layer
+	// or any layer over it are composed again.
+	uint32_t dirty[FB_ROW_WORDS] = {0};
+	uint32_t fused[FB_ROW_WORDS];
+	uint64_t used = 0;
+
+	if (app->render_target == RENDER_TARGET_INDEXED && 
+		(app->palette.full || app->palette.meta_generation != app->meta.generation))
+		rebuild_palette(app);
+
+	for (int y=0; y<LCD_HEIGHT; y++)
+		used |= app->line_layers[y];
+
+	// Rows composed by lines are right only if they went by the same layers
+	memcpy(fused, app->fused_rows, sizeof(fused));
+	memset(app->fused_rows, 0, sizeof(app->fused_rows));
+	if (used != app->used_layers)
+		memset(fused, 0, sizeof(fused));
+	app->used_layers = used;
+
+	switch (app->render_target){
+	case RENDER_TARGET_ABUFFER:
+		// Fragments are resolved when drawn, nothing to compose
+		return;
+
+	case RENDER_TARGET_INDEXED:
+		plan_indexed_framebuffers(app, used);
+		workers_run(&app->compose_workers, compose_band, app);
+		return;
+
+	default:
+		break;
+	}
+
 	// FROM FRONT TO BACK
-    for (int i = Z_LAYERS - 1; i > 0; i--) {
-        compose_framebuffers(
-            &app->framebuffers[i],
-            &app->framebuffers[i - 1]
-        );
-    }
+	for (int i = app->layers_count - 1; i >= 0; i--){
+		framebuffer_t *fb = &app->framebuffers[i];
+		framebuffer_t *layer = &app->layers[i];
+		framebuffer_t *over = i < (int)app->layers_count - 1 ? &app->framebuffers[i + 1] : NULL;
+		bool was_used = fb->used_flag;
+
+		for (int w=0; w<FB_ROW_WORDS; w++){
+			dirty[w] |= layer->dirty_rows[w];
+			layer->dirty_rows[w] = 0;
+		}
+
+		fb->used_flag = (used >> i) & 1;
+		fb->copy = NULL;
+		memset(app->compose_rows[i], 0, sizeof(app->compose_rows[i]));
+
+		// What is drawn for the layer changes on the same rows whether it
+		// gets composed or aliased, they add up until it is drawn
+		for (int w=0; w<FB_ROW_WORDS; w++)
+			fb->dirty_rows[w] |= dirty[w];
+
+		if (fb->used_flag){
+			// Rows not painted on the layer alias the row over them, only
+			// the painted ones are composed. Fused rows are already composed,
+			// only marked. A layer that was aliased or unused has no rows
+			// to keep.
+			uint32_t painted[FB_ROW_WORDS] = {0};
+			for (int y=0; y<LCD_HEIGHT; y++){
+				if (over == NULL || ((app->line_layers[y] >> i) & 1)){
+					painted[y >> 5] |= (uint32_t)1 << (y & 31);
+					fb->row_owners[y] = i;
+				}
+				else fb->row_owners[y] = over->row_owners[y];
+			}
+
+			for (int w=0; w<FB_ROW_WORDS; w++){
+				uint32_t rows = was_used ? dirty[w] & ~fused[w] : all_rows[w];
+				app->compose_rows[i][w] = rows & painted[w];
+			}
+		}
+		else if (over != NULL){
+			fb->copy = over->copy != NULL ? over->copy : over;
+			memcpy(fb->row_owners, over->row_owners, sizeof(fb->row_owners));
+		}
+		else{
+			// Top layer, drawn through the copies of the ones behind it
+			memset(fb->row_owners, i, sizeof(fb->row_owners));
+			if (was_used){
+				memset(fb->pixels, 0, sizeof(fb->pixels));
+				memcpy(fb->dirty_rows, all_rows, sizeof(fb->dirty_rows));
+			}
+		}
+	}
+
+	workers_run(&app->compose_workers, compose_band, app);
+}
+
+int get_layer_rows(app_state *app, int z, layer_rows_t *runs, uint32_t *changed_rows){
+	// Pixels to draw for layer z, the layer with every one over it, as
+	// runs of rows. Rows aliased to a frame buffer over it are read from
+	// there. 0 runs when there is nothing to draw. changed_rows gets the
+	// rows that may have changed since the layer was last drawn.
+	if (app->render_target == RENDER_TARGET_ABUFFER){
+		if (!((app->used_layers >> z) & 1) && z == (int)app->layers_count - 1)
+			return 0;
+
+		abuffer_resolve_stack(app->abuffer, z, app->resolved);
+		memcpy(changed_rows, all_rows, sizeof(all_rows));
+		runs[0] = (layer_rows_t){0, LCD_HEIGHT, app->resolved};
+		return 1;
+	}
+
+	if (app->render_target == RENDER_TARGET_INDEXED){
+		// Expanded to full color only here, right before the upload
+		framebuffer8_t *fb = &app->framebuffers8[z];
+		if (fb->copy == NULL && !fb->used_flag)
+			return 0;
+
+		memcpy(changed_rows, fb->dirty_rows, sizeof(fb->dirty_rows));
+		memset(fb->dirty_rows, 0, sizeof(fb->dirty_rows));
+		if (fb->copy != NULL)
+			fb = fb->copy;
+
+		palette_expand(&app->palette, &fb->pixels[0][0], app->resolved, LCD_WIDTH*LCD_HEIGHT);
+		runs[0] = (layer_rows_t){0, LCD_HEIGHT, app->resolved};
+		return 1;
+	}
+
+	framebuffer_t *fb = &app->framebuffers[z];
+	if (fb->copy == NULL && !fb->used_flag)
+		return 0;
+
+	memcpy(changed_rows, fb->dirty_rows, sizeof(fb->dirty_rows));
+	memset(fb->dirty_rows, 0, sizeof(fb->dirty_rows));
+
+	int count = 0;
+	for (int y=0; y<LCD_HEIGHT; y++){
+		if (count > 0 && fb->row_owners[y] == fb->row_owners[y - 1]){
+			runs[count - 1].count++;
+			continue;
+		}
+
+		runs[count++] = (layer_rows_t){y, 1, &app->framebuffers[fb->row_owners[y]].pixels[y][0]};
+	}
+
+	return count;
+}
+
+int take_layer_rows(app_state *app, int z, uint32_t number, layer_rows_t *runs, uint32_t *changed_rows){
+	// get_layer_rows, stamping the rows whose hash changed since they were
+	// last taken with frame number. Only the changed_rows are sure to hold
+	// the layer's pixels, others may not be cleared yet.
+	int runs_count = get_layer_rows(app, z, runs, changed_rows);
+	for (int r=0; r<runs_count; r++){
+		for (int y=runs[r].y; y<runs[r].y + runs[r].count; y++){
+			if (!((changed_rows[y >> 5] >> (y & 31)) & 1))
+				continue;
+
+			const uint32_t *row = runs[r].pixels + (y - runs[r].y)*LCD_WIDTH;
+			uint32_t hash = fingerprint_crc32((const uint8_t *)row, sizeof(uint32_t)*LCD_WIDTH);
+			if (hash != app->row_hashes[z][y]){
+				app->row_hashes[z][y] = hash;
+				app->row_frames[z][y] = number;
+			}
+		}
+	}
+
+	return runs_count;
+}
+
+bool layer_row_taken(app_state *app, int z, int y, const uint32_t *row){
+	// The row holds the pixels last taken for it, whatever the dirty rows say
+	return fingerprint_crc32((const uint8_t *)row, sizeof(uint32_t)*LCD_WIDTH) == app->row_hashes[z][y];
+}
+
+void publish_frame(app_state *app){
+	// Hand the tiles over to the renderer, and the rows to draw when it
+	// runs apart from the emulation. A slot only copies the rows stamped
+	// since it was last filled. Without rows the renderer takes them from
+	// the layers itself.
+	frame_t *f = &app->frames[app->handoff.back];
+	uint32_t number = ++app->frames_published;
+	layer_rows_t runs[LCD_HEIGHT];
+	uint32_t changed[FB_ROW_WORDS];
+
+	f->drawn_layers = 0;
+	for (uint32_t i=0; f->rows != NULL && i<app->layers_count; i++){
+		int runs_count = take_layer_rows(app, i, number, runs, changed);
+		if (runs_count == 0) continue;
+
+		f->drawn_layers |= (uint64_t)1 << i;
+		for (int r=0; r<runs_count; r++){
+			for (int y=runs[r].y; y<runs[r].y + runs[r].count; y++){
+				if (app->row_frames[i][y] > f->layer_frames[i])
+					memcpy(f->rows[i*LCD_HEIGHT + y], runs[r].pixels + (y - runs[r].y)*LCD_WIDTH, sizeof(f->rows[0]));
+			}
+		}
+		f->layer_frames[i] = number;
+	}
+
+	sample_vram_tiles(&app->gb);
+	for (int i=0; i<VRAM_TILE_COUNT; i++){
+		memcpy(f->tiles[i], tiles_on_vram[i].raw_data, TILE_SIZE);
+		f->tile_hashes[i] = tiles_on_vram[i].hash;
+	}
+
+	if (f->rows != NULL)
+		memcpy(f->row_frames, app->row_frames, sizeof(f->row_frames[0])*app->layers_count);
+	memcpy(f->layer_z, app->meta.layer_z, sizeof(f->layer_z));
+	f->layers_count = app->layers_count;
+	f->planes_distance = app->planes_distance;
+	f->number = number;
+	handoff_publish(&app->handoff);
 }
 
 /* <== Callbacks ===============================================> */
@@ -397,10 +1436,156 @@ void gb_error(gb_s *gb, const enum gb_error_e gb_err, const uint16_t val){
 	exit(EXIT_FAILURE);
 }
 
+/* <== Emulation thread ========================================> */
+
+static void run_frame(app_state *app){
+	// Keys held are loaded from input, which may run on another thread
+	app->gb.direct.joypad = __atomic_load_n(&app->joypad, __ATOMIC_RELAXED);
+
+	/* Execute CPU cycles until the screen has to be redrawn. */
+	gb_run_frame(&app->gb);
+	lcd_finish_frame(app);
+}
+
+static void *emulation_main(void *arg){
+	// Runs, composes and publishes frames on absolute deadlines, so the
+	// rate stays at the Game Boy refresh whatever the renderer does
+	app_state *app = arg;
+	emulation_t *emu = &app->emulation;
+	const long period_ns = 1000000000.0 / VERTICAL_SYNC;
+	struct timespec next, now;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	pthread_mutex_lock(&emu->lock);
+	while (!emu->quit){
+		if (emu->paused){
+			emu->idle = true;
+			pthread_cond_broadcast(&emu->stopped);
+			while (emu->paused && !emu->quit)
+				pthread_cond_wait(&emu->wake, &emu->lock);
+
+			emu->idle = false;
+			clock_gettime(CLOCK_MONOTONIC, &next);
+			continue;
+		}
+		pthread_mutex_unlock(&emu->lock);
+
+		run_frame(app);
+		compose_all_framebuffers(app);
+		publish_frame(app);
+		__atomic_fetch_add(&emu->frames, 1, __ATOMIC_RELAXED);
+
+		// More than a frame late the debt is dropped instead of running
+		// frames back to back
+		next.tv_nsec += period_ns;
+		if (next.tv_nsec >= 1000000000L){
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double late_ns = (now.tv_sec - next.tv_sec)*1e9 + (now.tv_nsec - next.tv_nsec);
+		if (late_ns > period_ns) next = now;
+		else clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		pthread_mutex_lock(&emu->lock);
+	}
+
+	emu->idle = true;
+	pthread_cond_broadcast(&emu->stopped);
+	pthread_mutex_unlock(&emu->lock);
+	return NULL;
+}
+
+int start_emulation_thread(app_state *app){
+	// Started paused, it runs once the command bar closes. Returns 0 on
+	// success.
+	emulation_t *emu = &app->emulation;
+	if (emu->running) return 0;
+
+	pthread_mutex_init(&emu->lock, NULL);
+	pthread_cond_init(&emu->wake, NULL);
+	pthread_cond_init(&emu->stopped, NULL);
+	emu->paused = true;
+	emu->idle = false;
+	emu->quit = false;
+
+	if (pthread_create(&emu->thread, NULL, emulation_main, app)){
+		pthread_cond_destroy(&emu->stopped);
+		pthread_cond_destroy(&emu->wake);
+		pthread_mutex_destroy(&emu->lock);
+		return -1;
+	}
+
+	emu->running = true;
+	return 0;
+}
+
+void stop_emulation_thread(app_state *app){
+	emulation_t *emu = &app->emulation;
+	if (!emu->running) return;
+
+	pthread_mutex_lock(&emu->lock);
+	emu->quit = true;
+	pthread_cond_broadcast(&emu->wake);
+	pthread_mutex_unlock(&emu->lock);
+	pthread_join(emu->thread, NULL);
+
+	pthread_cond_destroy(&emu->stopped);
+	pthread_cond_destroy(&emu->wake);
+	pthread_mutex_destroy(&emu->lock);
+	emu->running = false;
+	emu->paused = false;
+}
+
+void pause_emulation(app_state *app, bool paused){
+	// Stop the thread between frames or let it go on, once it stopped the
+	// emulation and the render buffers belong to the caller
+	emulation_t *emu = &app->emulation;
+	if (!emu->running) return;
+
+	pthread_mutex_lock(&emu->lock);
+	emu->paused = paused;
+	pthread_cond_broadcast(&emu->wake);
+	while (paused && !emu->idle)
+		pthread_cond_wait(&emu->stopped, &emu->lock);
+	pthread_mutex_unlock(&emu->lock);
+}
+
+static inline bool emulation_threaded(app_state *app){
+	// Frames run on the emulation thread, not on the main one
+	return app->emulation.running && !app->emulation.paused;
+}
+
 /* <== Frontend ================================================> */
 
+static void handle_inspector_input(void){
+	if (IsKeyPressed(KEY_D) && selected_tile < VRAM_TILE_COUNT-1)
+		selected_tile++;
+	if (IsKeyPressed(KEY_S) && selected_tile < VRAM_TILE_COUNT-VRAM_INSPECTOR_WIDTH)
+		selected_tile+=VRAM_INSPECTOR_WIDTH;
+	if (IsKeyPressed(KEY_A) && selected_tile > 0)
+		selected_tile--;
+	if (IsKeyPressed(KEY_W) && selected_tile >= VRAM_INSPECTOR_WIDTH)
+		selected_tile-=VRAM_INSPECTOR_WIDTH;
+}
+
 static int on_gb_running_state(app_state *app){
 	if (app->paused) return 0;
+
+	// The emulation thread keeps its own pace, only input is handled here
+	if (app->emulation.running){
+		handle_input(app);
+		if (IsKeyPressed(KEY_SPACE)){
+			pause_emulation(app, true);
+			app->state_machine = ON_COMMAND_BAR_STATE;
+			return 0;
+		}
+
+		handle_inspector_input();
+		return 0;
+	}
+
 	const double target_speed_us = 1000000.0 / VERTICAL_SYNC;
 	int_fast16_t delay;
 	unsigned long start, end;
@@ -412,9 +1597,7 @@ static int on_gb_running_state(app_state *app){
 		(long)timecheck.tv_usec;
 
 	handle_input(app);
-
-	/* Execute CPU cycles until the screen has to be redrawn. */
-	gb_run_frame(&app->gb);
+	run_frame(app);
 
 	gettimeofday(&timecheck, NULL);
 	end = (long)timecheck.tv_sec * 1000000 + (long)timecheck.tv_usec;
@@ -424,6 +1607,9 @@ static int on_gb_running_state(app_state *app){
 		app->state_machine = ON_COMMAND_BAR_STATE;
 		return 0;
 	}
+
+	// Headless runs go as fast as they can
+	if (app->headless.enabled) return 0;
 	
 	delay = target_speed_us - (end - start);
 
@@ -437,19 +1623,25 @@ static int on_gb_running_state(app_state *app){
 	usleep(delay);
 
 	// TILES INSPECTOR LOGIC
-	sample_vram_tiles(&app->gb, tiles_on_vram);
-	if (IsKeyPressed(KEY_D) && selected_tile < VRAM_TILE_COUNT-1)
-		selected_tile++;
-	if (IsKeyPressed(KEY_S) && selected_tile < VRAM_TILE_COUNT-VRAM_INSPECTOR_WIDTH)
-		selected_tile+=VRAM_INSPECTOR_WIDTH;
-	if (IsKeyPressed(KEY_A) && selected_tile > 0)
-		selected_tile--;
-	if (IsKeyPressed(KEY_W) && selected_tile >= VRAM_INSPECTOR_WIDTH)
-		selected_tile-=VRAM_INSPECTOR_WIDTH;
+	handle_inspector_input();
 
 	return 0;
 }
 
+static void run_command(app_state *app, char *text){
+	// Split a command line on spaces and run it, the text is modified
+	char *argv[32];
+	int argc = 0;
+	while (argc < 31){
+		argv[argc] = strtok(argc > 0 ? NULL:text," ");
+		if (argv[argc] == NULL) break;
+		argc++;
+	}
+	
+	exec_cmd(app, argc, argv);
+	sync_layers(app);
+}
+
 static void on_command_bar_state(app_state *app){
 	// ADD CHARACTERS
 	char pressedChar;
@@ -472,15 +1664,7 @@ static void on_command_bar_state(app_state *app){
 
 	// ACCEPT COMMAND
 	if (IsKeyPressed(KEY_ENTER)){
-		char *argv[32];
-		int argc = 0;
-		while (true){
-			argv[argc] = strtok(argc > 0 ? NULL:app->commandbar.text," ");
-			if (argv[argc] == NULL) break;
-			argc++;
-		}
-		
-		exec_cmd(app, argc, argv);
+		run_command(app, app->commandbar.text);
 		goto end;
 	}
 
@@ -491,6 +1675,7 @@ static void on_command_bar_state(app_state *app){
 	app->commandbar.text_len = 0;
 	app->commandbar.cursor = 0;
 	app->state_machine = GB_RUNNING_STATE;
+	pause_emulation(app, false);
 	return;
 }
 
@@ -505,6 +1690,12 @@ static int main_loop(app_state *app){
 
 static int init(app_state *app, char* rom_filename){
 	memset(app, 0, sizeof(*app));
+	init_meta(&app->meta, Z_LAYERS);
+	fingerprint_init();
+	compose_init();
+	workers_start(&app->compose_workers, 1);
+	handoff_init(&app->handoff);
+	app->joypad = 255;
 	
 	// Copy input ROM file to allocated memory (esto aloja memoria)
 	app->rom = read_rom_to_ram(rom_filename);
@@ -536,29 +1727,86 @@ static int init(app_state *app, char* rom_filename){
 
 	// Init LCD
 	gb_init_lcd(&app->gb, &lcd_render_line);
+	lcd_init();
+	sample_vram_tiles(&app->gb);
 	//app->gb.direct.interlace = true;
 	//app->gb.direct.frame_skip = true;
 
 	// Init framebuffers
 	app->planes_distance = PLANES_DISTANCE_DEFAULT;
-	app->framebuffers = malloc(sizeof(framebuffer_t)*Z_LAYERS);
-	reset_framebuffers(app);
+	app->framebuffers = app->layers = NULL;
+	app->framebuffers8 = app->layers8 = NULL;
+	app->abuffer = NULL;
+	app->resolved = NULL;
+	memset(app->line_layers, 0, sizeof(app->line_layers));
+	uint32_t transparent[LCD_WIDTH] = {0};
+	uint32_t transparent_hash = fingerprint_crc32((const uint8_t *)transparent, sizeof(transparent));
+	for (int i=0; i<Z_LAYERS; i++){
+		for (int y=0; y<LCD_HEIGHT; y++)
+			app->row_hashes[i][y] = transparent_hash;
+	}
+	app->render_target = RENDER_TARGET_DEFAULT;
+	if (set_arena_pages(app, ARENA_PAGES_DEFAULT)){
+		printf("%d: %s\n", __LINE__, "render buffers could not be mapped");
+		return EXIT_FAILURE;
+	}
 
 	return 0;
 }
 
 static void shutdown(app_state *app){
-	free(app->framebuffers);
+	stop_emulation_thread(app);
+	workers_stop(&app->compose_workers);
+	free_meta(&app->meta);
+	arena_free(&app->arena);
 	free(app->cart_ram);
 	free(app->rom);
 }
 
+static void usage(const char *name){
+	fprintf(stderr, 
+		"%s ROM [--headless FRAMES] [--dump composite|layers DIR] [--exec COMMAND]...\n"
+		"  --headless FRAMES  run FRAMES frames with no window, 0 runs until killed\n"
+		"  --dump MODE DIR    write every headless frame, the whole screen or each layer\n"
+		"  --exec COMMAND     run a command bar command before the first frame\n", 
+		name
+	);
+}
+
 int main(int argc, char **argv){
-	// Rom name reading
+	// Rom name and options reading
 	char *rom_filename = NULL;
-	if (argc == 2) rom_filename = argv[1];
-	else{
-		fprintf(stderr, "%s ROM\n", argv[0]);
+	headless_t headless = {0};
+	char *commands[32];
+	int commands_count = 0;
+
+	for (int i=1; i<argc; i++){
+		if (!strcmp(argv[i], "--headless") && i + 1 < argc){
+			headless.enabled = true;
+			headless.frames = strtoul(argv[++i], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--dump") && i + 2 < argc){
+			if (!strcmp(argv[i + 1], "composite")) headless.dump = DUMP_COMPOSITE;
+			else if (!strcmp(argv[i + 1], "layers")) headless.dump = DUMP_LAYERS;
+			else{
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			headless.dump_dir = argv[i + 2];
+			i += 2;
+		}
+		else if (!strcmp(argv[i], "--exec") && i + 1 < argc && commands_count < 32)
+			commands[commands_count++] = argv[++i];
+		else if (argv[i][0] != '-' && rom_filename == NULL)
+			rom_filename = argv[i];
+		else{
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (rom_filename == NULL || (headless.dump != DUMP_NONE && !headless.enabled)){
+		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 	
@@ -568,22 +1816,27 @@ int main(int argc, char **argv){
 	int ret = init(&app, rom_filename) != 0;
 	if (ret != 0) return ret;
 
+	app.headless = headless;
 	ray_init(&app);
 
+	for (int i=0; i<commands_count; i++)
+		run_command(&app, commands[i]);
+	pause_emulation(&app, false);
+
 	// App pipeline
 	printf("p1 = %p\n",&app);
-	while(!WindowShouldClose()){
+	while(!ray_should_close(&app)){
 		if (main_loop(&app) != 0) break;
-		compose_all_framebuffers(&app);
-		ray_update(&app);
-		if (app.state_machine == GB_RUNNING_STATE){
-			reset_framebuffers(&app);
+		if (!emulation_threaded(&app)){
+			compose_all_framebuffers(&app);
+			publish_frame(&app);
 		}
+		ray_update(&app);
 	}
 
 	// App end
 	shutdown(&app);
-	CloseWindow();
+	ray_close(&app);
 
 	return EXIT_SUCCESS;
 }
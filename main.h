@@ -2,9 +2,15 @@
 #define MAIN_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <raylib.h>
 #include "peanut_gb.h"
 #include "meta.h"
+#include "abuffer.h"
+#include "palette.h"
+#include "workers.h"
+#include "arena.h"
+#include "handoff.h"
 
 #define ENABLE_SOUND 0
 #define ENABLE_LCD 1
@@ -13,7 +19,10 @@
 #define TILE_SIZE 16
 
 #define VRAM_INSPECTOR_WIDTH 10
-#define Z_LAYERS 50
+#define Z_LAYERS 50                     // Depths a profile can use
+#if Z_LAYERS > 64
+#error "app_state line_layers holds one bit per layer"
+#endif
 #define PLANES_DISTANCE_DEFAULT 0.2f
 #define BG_COLOR CLITERAL(Color){ 230, 224, 210, 255 }
 
@@ -22,9 +31,37 @@ typedef enum{
 	ON_COMMAND_BAR_STATE
 } state_t;
 
+typedef enum{
+	RENDER_TARGET_LAYERS,               // One full screen buffer per z
+	RENDER_TARGET_ABUFFER,              // Sorted fragments per pixel, resolved on draw
+	RENDER_TARGET_INDEXED               // One byte palette index per pixel and z
+} render_target_t;
+
+#define RENDER_TARGET_DEFAULT RENDER_TARGET_LAYERS
+#define ARENA_PAGES_DEFAULT ARENA_PAGES_THP
+
+typedef enum{
+	DUMP_NONE,
+	DUMP_COMPOSITE,                     // The whole screen, every layer composed
+	DUMP_LAYERS                         // Every layer drawn, with the ones over it
+} dump_t;
+
+// Runs with no window for batch jobs and machines with no display,
+// frames run as fast as they can
+typedef struct headless{
+	bool enabled;
+	uint32_t frames;                    // Frames to run, 0 runs until killed
+	uint32_t frames_run;
+	dump_t dump;
+	const char *dump_dir;               // Dumped frames are written here as PNG
+} headless_t;
+
 typedef struct tile{
 	uint8_t *raw_data;
 	uint32_t hash;
+	meta_t *meta;                       // Resolved meta, NULL if the tile has none
+	uint32_t meta_generation;           // Meta store generation it was resolved at
+	bool meta_valid;                    // Cleared when the tile data changes
 } tile_t;
 
 typedef struct commandbar{
@@ -33,31 +70,142 @@ typedef struct commandbar{
 	int cursor;
 } commandbar_t;
 
+#define FB_ROW_WORDS ((LCD_HEIGHT + 31) / 32)
+
 typedef struct framebuffer{
-    uint32_t pixels[LCD_HEIGHT][LCD_WIDTH];
+    uint32_t pixels[LCD_HEIGHT][LCD_WIDTH] __attribute__((aligned(ARENA_ALIGN)));
+    uint32_t dirty_rows[FB_ROW_WORDS];  // Rows changed since the last compose, on
+                                        // frame buffers since the last draw
+    uint32_t row_stamps[LCD_HEIGHT];    // Line generation each row was painted at
+    uint8_t row_owners[LCD_HEIGHT];     // Frame buffer each row is read from, itself
+                                        // unless it aliases the row over it
     bool used_flag;
 	struct framebuffer *copy;
 } framebuffer_t;
 
+// Same as framebuffer_t, holding indices into the app palette
+typedef struct framebuffer8{
+    uint8_t pixels[LCD_HEIGHT][LCD_WIDTH] __attribute__((aligned(ARENA_ALIGN)));
+    uint32_t dirty_rows[FB_ROW_WORDS];
+    bool used_flag;
+	struct framebuffer8 *copy;
+} framebuffer8_t;
+
+// Run of rows of a layer to draw, read from one frame buffer
+typedef struct layer_rows{
+	int y;
+	int count;
+	const uint32_t *pixels;             // count rows from row y
+} layer_rows_t;
+
+// A frame handed over from emulation to drawing, everything the
+// renderer reads
+typedef struct frame{
+	uint32_t number;                    // Frames published up to this one
+	uint32_t layers_count;
+	uint64_t drawn_layers;              // Layers with rows to draw, one bit per layer
+	uint8_t layer_z[Z_LAYERS];          // Depth of each layer
+	float planes_distance;
+	uint32_t (*rows)[LCD_WIDTH];        // Rows of every layer, one layer after the other,
+	                                    // NULL unless the emulation thread runs
+	uint32_t layer_frames[Z_LAYERS];    // Frame each layer of rows was copied at
+	uint32_t row_frames[Z_LAYERS][LCD_HEIGHT]; // Frame each row last changed at
+	uint8_t tiles[VRAM_TILE_COUNT][TILE_SIZE];
+	uint32_t tile_hashes[VRAM_TILE_COUNT];
+} frame_t;
+
+// Thread running frames at the Game Boy refresh rate, stopped between
+// frames while anything else touches the emulation
+typedef struct emulation{
+	pthread_t thread;
+	bool running;                       // The thread exists
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t stopped;
+	bool paused;                        // Asked to stop between frames
+	bool idle;                          // Stopped between frames
+	bool quit;
+	uint32_t frames;                    // Frames run, read for the frame rate
+} emulation_t;
+
 // rom, cart_ram y fb pertenecen a una pseudo estructura "priv" que gb espera
 // esos deberían estar dentro de gb_s creo
 typedef struct app_state{
 	uint8_t *rom;                       // Pointer to allocated memory holding GB file.
 	uint8_t *cart_ram;                  // Pointer to allocated memory holding save file.
 	framebuffer_t *framebuffers;        // Frame buffers
+	framebuffer_t *layers;              // Painted layers, kept between frames
+	uint64_t line_layers[LCD_HEIGHT];   // Layers painted on each line, one bit per z
+	uint32_t line_generations[LCD_HEIGHT]; // Bumped to clear a line on every layer,
+	                                    // rows stamped before are transparent
+	uint64_t used_layers;               // Layers painted this frame, one bit per z
+	uint32_t layers_count;              // Layers allocated, one per depth in use
+	uint32_t layers_generation;         // Meta store layers they were laid out for
+	bool fused_compose;                 // Compose each line right after painting it
+	uint64_t line_cleared[LCD_HEIGHT];  // Layers cleared on a line since its compose
+	uint32_t fused_rows[FB_ROW_WORDS];  // Rows composed by lines this frame
+	uint32_t compose_rows[Z_LAYERS][FB_ROW_WORDS]; // Rows each layer composes this frame
+	workers_t compose_workers;          // Threads composing bands of rows
+	render_target_t render_target;
+	abuffer_t *abuffer;                 // Fragment buffer, replaces both sets of layers
+	framebuffer8_t *framebuffers8;      // Indexed frame buffers
+	framebuffer8_t *layers8;            // Indexed painted layers
+	palette_t palette;                  // Colors of the indexed layers
+	bool indexed_fallback;              // Indexed ran out of colors, layers are
+	                                    // painted instead until the layout changes
+	uint32_t *resolved;                 // Plane the fragment buffer or an indexed
+	                                    // frame buffer is expanded into
+	arena_t arena;                      // Render buffers, carved again on every layout
+	frame_t frames[HANDOFF_SLOTS];      // Frames handed over to drawing
+	size_t frames_mark;                 // Arena used before the frames rows
+	handoff_t handoff;
+	uint32_t frames_published;
+	uint32_t row_frames[Z_LAYERS][LCD_HEIGHT]; // Frame each drawn row last changed at
+	uint32_t row_hashes[Z_LAYERS][LCD_HEIGHT]; // Hash of each drawn row when last taken
+	uint8_t joypad;                     // Keys held, stored by input and loaded by
+	                                    // emulation, atomic
+	emulation_t emulation;
+	headless_t headless;                // No window when enabled
 	float planes_distance;
 	state_t state_machine;
 	bool paused;
 	commandbar_t commandbar;
-	meta_t *meta;                       // Tiles metadata linked list
+	meta_store_t meta;                  // Tiles metadata store
 	gb_s gb;                            // Emulator context
 } app_state;
 
-extern const float intensity_levels[];
 extern tile_t tiles_on_vram[VRAM_TILE_COUNT];
 extern int selected_tile;
 
 //void sort_framebuffers_by_z(app_state *app);
-void draw_to_framebuffer(app_state *app, uint32_t z, int x, int y, Color color);
+uint32_t get_tile_hash(gb_s *gb, uint16_t tile_i);
+void sample_vram_tiles(gb_s *gb);
+meta_t *resolve_tile_meta(app_state *app, uint16_t tile_i);
+void set_render_target(app_state *app, render_target_t target);
+int set_arena_pages(app_state *app, arena_pages_t pages);
+void sync_layers(app_state *app);
+void compose_all_framebuffers(app_state *app);
+int get_layer_rows(app_state *app, int z, layer_rows_t *runs, uint32_t *changed_rows);
+int take_layer_rows(app_state *app, int z, uint32_t number, layer_rows_t *runs, uint32_t *changed_rows);
+bool layer_row_taken(app_state *app, int z, int y, const uint32_t *row);
+void carve_frames(app_state *app);
+void publish_frame(app_state *app);
+int start_emulation_thread(app_state *app);
+void stop_emulation_thread(app_state *app);
+void pause_emulation(app_state *app, bool paused);
+void clear_framebuffer_line(app_state *app, int y);
+void compose_framebuffer_line(app_state *app, int y);
+void fill_framebuffer_span(app_state *app, uint32_t z, int x, int y, int len, Color color);
+void write_framebuffer_span(app_state *app, uint32_t z, int x, int y, int len, const Color *colors);
+
+static inline meta_t *get_tile_meta(app_state *app, uint16_t tile_i){
+	// Only resolve again if the tile data or the meta store changed
+	tile_t *t = &tiles_on_vram[tile_i];
+	uint32_t dirty = app->gb.display.tiles_dirty[tile_i >> 5] & ((uint32_t)1 << (tile_i & 31));
+	if (!dirty && t->meta_valid && t->meta_generation == app->meta.generation)
+		return t->meta;
+
+	return resolve_tile_meta(app, tile_i);
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,30 @@
+#include <stdint.h>
+#include <string.h>
+#include "palette.h"
+
+void palette_reset(palette_t *p, uint32_t meta_generation){
+	memset(p, 0, sizeof(palette_t));
+	p->count = 1;
+	p->meta_generation = meta_generation;
+}
+
+uint8_t palette_add(palette_t *p, uint32_t color){
+	// Out of indices, the color is lost until the palette is built again
+	if (p->count == PALETTE_SIZE){
+		p->full = true;
+		return 0;
+	}
+
+	uint32_t h = (color * 0x9E3779B1u) >> (32 - PALETTE_HASH_BITS);
+	while (p->slots[h])
+		h = (h + 1) & ((1 << PALETTE_HASH_BITS) - 1);
+
+	p->colors[p->count] = color;
+	p->slots[h] = p->count;
+	return p->count++;
+}
+
+void palette_expand(const palette_t *p, const uint8_t *in, uint32_t *out, int n){
+	for (int i=0; i<n; i++)
+		out[i] = p->colors[in[i]];
+}
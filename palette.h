@@ -0,0 +1,37 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PALETTE_SIZE 256                    // Index 0 is always transparent
+#define PALETTE_HASH_BITS 9
+
+// Colors painted on indexed layers, kept until it fills up or the metas
+// change, then built again from the lines on screen
+typedef struct palette{
+	uint32_t colors[PALETTE_SIZE];
+	uint8_t slots[1 << PALETTE_HASH_BITS];  // Color hash to index, 0 if empty
+	int count;
+	bool full;                              // A color did not fit since the last reset
+	uint32_t meta_generation;               // Meta store generation it was built at
+} palette_t;
+
+void palette_reset(palette_t *p, uint32_t meta_generation);
+uint8_t palette_add(palette_t *p, uint32_t color);
+void palette_expand(const palette_t *p, const uint8_t *in, uint32_t *out, int n);
+
+static inline uint8_t palette_index(palette_t *p, uint32_t color){
+	// Every transparent color shares index 0
+	if (!(color & 0xFF000000u)) return 0;
+
+	uint32_t h = (color * 0x9E3779B1u) >> (32 - PALETTE_HASH_BITS);
+	while (p->slots[h]){
+		if (p->colors[p->slots[h]] == color) return p->slots[h];
+		h = (h + 1) & ((1 << PALETTE_HASH_BITS) - 1);
+	}
+
+	return palette_add(p, color);
+}
+
+#endif
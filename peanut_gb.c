@@ -221,7 +221,17 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 
 	case 0x8:
 	case 0x9:
+		if(gb->vram[addr - VRAM_ADDR] == val)
+			return;
+
 		gb->vram[addr - VRAM_ADDR] = val;
+
+		/* Mark the tile as dirty if tile data was written. */
+		if(addr < VRAM_ADDR + VRAM_BMAP_1)
+		{
+			uint_fast16_t t = (addr - VRAM_ADDR) >> 4;
+			gb->display.tiles_dirty[t >> 5] |= (uint32_t)1 << (t & 31);
+		}
 		return;
 
 	case 0xA:
@@ -285,7 +295,11 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 
 		if(addr < UNUSED_ADDR)
 		{
-			gb->oam[addr - OAM_ADDR] = val;
+			if(gb->oam[addr - OAM_ADDR] != val)
+			{
+				gb->oam[addr - OAM_ADDR] = val;
+				gb->display.oam_dirty = true;
+			}
 			return;
 		}
 
@@ -367,6 +381,10 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			/* Check if LCD is already enabled. */
 			lcd_enabled = (gb->hram_io[IO_LCDC] & LCDC_ENABLE);
 
+			/* Sprite heights change which lines sprites are on. */
+			if((gb->hram_io[IO_LCDC] ^ val) & LCDC_OBJ_SIZE)
+				gb->display.oam_dirty = true;
+
 			gb->hram_io[IO_LCDC] = val;
 
 			/* Check if LCD is going to be switched on. */
@@ -428,6 +446,8 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 				gb->oam[i] = __gb_read(gb, dma_addr + i);
 			}
 
+			gb->display.oam_dirty = true;
+
 			return;
 		}
 
@@ -2546,6 +2566,10 @@ void gb_reset(struct gb_s *gb)
 		gb->hram_io[IO_BOOT] = 0x00;
 	}
 
+	/* Tile data is unknown to the front-end after a reset. */
+	memset(gb->display.tiles_dirty, 0xFF, sizeof(gb->display.tiles_dirty));
+	gb->display.oam_dirty = true;
+
 	gb->counter.lcd_count = 0;
 	gb->counter.div_count = 0;
 	gb->counter.tima_count = 0;
@@ -218,6 +218,8 @@
 #define VRAM_BMAP_2         (0x9C00 - VRAM_ADDR)
 #define VRAM_TILES_3        (0x8000 - VRAM_ADDR + VRAM_BANK_SIZE)
 #define VRAM_TILES_4        (0x8800 - VRAM_ADDR + VRAM_BANK_SIZE)
+/* Number of 16 byte tiles between 0x8000 and 0x97FF. */
+#define VRAM_TILES_NUM      0x180
 
 /* Interrupt jump addresses */
 #define VBLANK_INTR_ADDR    0x0040
@@ -691,9 +693,18 @@ typedef struct gb_s
 		uint8_t window_clear;
 		uint8_t WY;
 
+		/* One bit per VRAM tile, set when a write changes the tile
+		 * data. Cleared by the front-end once it has consumed the
+		 * change. */
+		uint32_t tiles_dirty[VRAM_TILES_NUM / 32];
+
 		/* Only support 30fps frame skip. */
 		bool frame_skip_count : 1;
 		bool interlace_count : 1;
+
+		/* Set when OAM or the sprite size changes, cleared by the
+		 * front-end once it has rebuilt its sprite lists. */
+		bool oam_dirty : 1;
 	} display;
 
 	/**
@@ -3,11 +3,17 @@
 #include <string.h>
 #include "main.h"
 #include "peanut_gb.h"
+#include "headless_backend.h"
 
 float camera_distance = 10.0f;
 Camera3D camera;
 
 void ray_init(app_state *app){
+	if (app->headless.enabled){
+		headless_init(app);
+		return;
+	}
+
 	SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(200, 200, "3DGB");
 	SetTargetFPS(60);
@@ -23,76 +29,159 @@ void ray_init(app_state *app){
 	};
 }
 
-static void __draw_framebuffers(app_state *app){
-	static Texture buffers_textures[256];
-    static int buffers_textures_i = 0;
-    
-    BeginMode3D(camera);
-	
-    for (int i=0; i<Z_LAYERS; i++){
-		
-		framebuffer_t *fb = &app->framebuffers[i];
-		if (!fb->used_flag && fb->copy == NULL){
-			continue;
-		}
+#define ATLAS_COLUMN_LAYERS 14             // Layers one over the other in a column
+#define ATLAS_COLUMNS ((Z_LAYERS + ATLAS_COLUMN_LAYERS - 1) / ATLAS_COLUMN_LAYERS)
+#define ATLAS_MERGE_ROWS 16                // Unchanged rows uploaded to save a call
+
+static Rectangle __atlas_rect(int layer){
+    return (Rectangle){
+        (layer / ATLAS_COLUMN_LAYERS) * LCD_WIDTH, 
+        (layer % ATLAS_COLUMN_LAYERS) * LCD_HEIGHT, 
+        LCD_WIDTH, LCD_HEIGHT
+    };
+}
+
+static void __upload_stretch(Texture atlas, const uint32_t *pixels, int first, int last){
+    // Rows first to last of the stack, all in the same column, pixels
+    // holds them one after the other
+    int c = first / (ATLAS_COLUMN_LAYERS*LCD_HEIGHT);
+    if (last < first) return;
+
+    UpdateTextureRec(
+        atlas, 
+        (Rectangle){
+            c*LCD_WIDTH, first - c*ATLAS_COLUMN_LAYERS*LCD_HEIGHT, 
+            LCD_WIDTH, last - first + 1
+        }, 
+        pixels
+    );
+}
+
+static uint32_t staging[LCD_HEIGHT][LCD_WIDTH];              // Rows of a layer taken on this thread
+
+static bool __stage_rows(app_state *app, int z, const layer_rows_t *runs, const uint32_t *changed, int first, int end){
+    // Copies rows first to end - 1 of layer z to the staging rows, false
+    // if one does not hold what the atlas has. Rows not changed may not
+    // be cleared yet, those are checked against the hash they were last
+    // taken with.
+    for (int y=first, r=0; y<end; y++){
+        while (y >= runs[r].y + runs[r].count) r++;
+        const uint32_t *row = runs[r].pixels + (y - runs[r].y)*LCD_WIDTH;
+        if (!((changed[y >> 5] >> (y & 31)) & 1) && !layer_row_taken(app, z, y, row))
+            return false;
+
+        memcpy(staging[y], row, sizeof(staging[y]));
+    }
+    return true;
+}
+
+static void __draw_framebuffers(app_state *app, const frame_t *f){
+    // The whole stack lives in one atlas texture. Rows changed since the
+    // frame a layer was last uploaded from are uploaded in stretches, and
+    // every plane is drawn from the same texture, so raylib batches them
+    // all in one draw. A frame without rows was published on this thread,
+    // the rows are taken from the layers right away.
+	static Texture atlas;
+    static const uint32_t transparent[LCD_HEIGHT][LCD_WIDTH];
+    static uint32_t uploaded[Z_LAYERS];                       // Frame each layer was uploaded from
+    uint64_t drawn_layers = f->drawn_layers;
+    const uint32_t (*row_frames)[LCD_HEIGHT] = f->rows != NULL ? f->row_frames : app->row_frames;
+    layer_rows_t runs[LCD_HEIGHT];
+    uint32_t changed[FB_ROW_WORDS];
+    int first = 0, last = -1;                                 // Stretch of rows to upload
+    const uint32_t *first_pixels = NULL;
+
+    // CREATE THE ATLAS, transparent like rows never published
+    if (atlas.id == 0){
+        Image img = (Image){
+            NULL,
+            LCD_WIDTH*ATLAS_COLUMNS, LCD_HEIGHT*ATLAS_COLUMN_LAYERS,
+            1,
+            PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+        };
+
+        atlas = LoadTextureFromImage(img);
+        for (int i=0; i<Z_LAYERS; i++)
+            UpdateTextureRec(atlas, __atlas_rect(i), transparent);
+    }
+
+    // UPLOAD THE CHANGED ROWS, stretches close enough in the same column
+    // go in one upload. Taken here, a layer's rows are staged and its
+    // stretches uploaded before the next one is taken.
+    for (int i=0; i<(int)f->layers_count; i++){
+        if (f->rows == NULL && take_layer_rows(app, i, f->number, runs, changed) > 0)
+            drawn_layers |= (uint64_t)1 << i;
+
+        if (!((drawn_layers >> i) & 1))
+            continue;
 
-		float z = i*app->planes_distance;
-		uint32_t *pixels = &fb->pixels[0][0];
-		if (fb->copy != NULL)
-			pixels = &fb->copy->pixels[0][0];
-
-        // CONVERT FRAMEBUFFER INTO A TEXTURE
-        if (buffers_textures[buffers_textures_i].id == 0){
-            Image img = (Image){
-                pixels,
-                LCD_WIDTH, LCD_HEIGHT,
-                1,
-                PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
-            };
-
-            buffers_textures[buffers_textures_i] = LoadTextureFromImage(img);
+        for (int y=0; y<LCD_HEIGHT; y++){
+            if (row_frames[i][y] <= uploaded[i])
+                continue;
+
+            int s = i*LCD_HEIGHT + y;
+            bool same_column = s / (ATLAS_COLUMN_LAYERS*LCD_HEIGHT) == first / (ATLAS_COLUMN_LAYERS*LCD_HEIGHT);
+            bool merge = last >= 0 && same_column && s - last <= ATLAS_MERGE_ROWS;
+            const uint32_t *pixels = f->rows != NULL ? f->rows[s] : staging[y];
+            if (f->rows == NULL){
+                merge = merge && __stage_rows(app, i, runs, changed, last - i*LCD_HEIGHT + 1, y);
+                __stage_rows(app, i, runs, changed, y, y + 1);
+            }
+
+            if (!merge){
+                __upload_stretch(atlas, first_pixels, first, last);
+                first = s;
+                first_pixels = pixels;
+            }
+            last = s;
         }
+        uploaded[i] = f->number;
 
-        else{
-            UpdateTexture(
-                buffers_textures[buffers_textures_i], 
-                pixels
-            );
+        if (f->rows == NULL){
+            __upload_stretch(atlas, first_pixels, first, last);
+            last = -1;
         }
-    
-        // RENDER THE FRAMEBUFFER AS A BILLBOARD
-        DrawBillboard(
-            camera, 
-            buffers_textures[buffers_textures_i], 
-            (Vector3){
-                camera.target.x, 
-                camera.target.y, 
-                camera.target.z + z
-            },
-            3.0, 
-            WHITE
-        );
+    }
+
+    __upload_stretch(atlas, first_pixels, first, last);
+
+    // RENDER EVERY LAYER AS A BILLBOARD, at its depth and every depth down
+    // to the layer behind it
+    BeginMode3D(camera);
+
+    for (int i=0; i<(int)f->layers_count; i++){
+        if (!((drawn_layers >> i) & 1))
+            continue;
 
-        // ADVANCE THE TEXTURE COUNTER
-        buffers_textures_i++;
-        if (buffers_textures_i >= 256)
-            buffers_textures_i = 0;
+        int depth = i > 0 ? f->layer_z[i - 1] + 1 : 0;
+        for (; depth <= f->layer_z[i]; depth++){
+            float z = depth*f->planes_distance;
+            DrawBillboardRec(
+                camera, 
+                atlas, 
+                __atlas_rect(i), 
+                (Vector3){
+                    camera.target.x, 
+                    camera.target.y, 
+                    camera.target.z + z
+                },
+                (Vector2){3.0*LCD_WIDTH/LCD_HEIGHT, 3.0}, 
+                WHITE
+            );
+        }
     }
 
 	EndMode3D();
 }
 
-static void __draw_tile(tile_t *t, int x, int y, float scale){
-	static Texture tiles_textures[VRAM_TILE_COUNT];
-    static int tiles_textures_i = 0;
+#define SHEET_ROWS ((VRAM_TILE_COUNT + VRAM_INSPECTOR_WIDTH - 1) / VRAM_INSPECTOR_WIDTH)
 
-    uint32_t fb[8][8];
-	
-	// PARSE THE TILE DATA INTO AN R8G8B8A8 IMAGE
+static void __decode_tile(const uint8_t *raw_data, uint32_t *out, int stride){
+	// PARSE THE TILE DATA INTO R8G8B8A8 PIXELS
     // *each line of the tile is 2 bytes long*
 	for (int i=0; i<TILE_SIZE/2; i++){
-		uint8_t lsb = t->raw_data[i*2];
-		uint8_t msb = t->raw_data[i*2+1];
+		uint8_t lsb = raw_data[i*2];
+		uint8_t msb = raw_data[i*2+1];
 
 		for (int o=0; o<8; o++){
 			int color_index  = ((lsb >> o) & 1) | (((msb >> o) & 1) << 1);			
@@ -103,85 +192,97 @@ static void __draw_tile(tile_t *t, int x, int y, float scale){
 				255
 			};
 
-            memcpy(&fb[i][7-o], &color, sizeof(uint32_t));
+            memcpy(&out[i*stride + 7-o], &color, sizeof(uint32_t));
 		}
-
 	}
+}
 
-	// CONVERT PREVIOUS IMAGE INTO A TEXTURE
-	if (tiles_textures[tiles_textures_i].id == 0){
-		Image i = (Image){
-			&(fb[0][0]),
-			8, 8,
-			1,
-			PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
-		};
+static void __draw_vram_tiles(const frame_t *f, int x, int y, float scale){
+    // Every tile lives in one sheet laid out like the inspector, only the
+    // tiles whose hash changed since the last frame are decoded again
+    static Texture sheet;
+    static uint32_t pixels[SHEET_ROWS*8][VRAM_INSPECTOR_WIDTH*8];
+    static uint32_t hashes[VRAM_TILE_COUNT];
+    uint64_t changed_rows = 0;
+    bool whole = sheet.id == 0;
 
-		tiles_textures[tiles_textures_i] = LoadTextureFromImage(i);
-	}
+	for (int i=0; i<VRAM_TILE_COUNT; i++){
+		if (!whole && f->tile_hashes[i] == hashes[i])
+            continue;
 
-	else{
-		UpdateTexture(tiles_textures[tiles_textures_i], &(fb[0][0]));
+        int row = i / VRAM_INSPECTOR_WIDTH, column = i % VRAM_INSPECTOR_WIDTH;
+        hashes[i] = f->tile_hashes[i];
+        __decode_tile(f->tiles[i], &pixels[row*8][column*8], VRAM_INSPECTOR_WIDTH*8);
+        changed_rows |= (uint64_t)1 << row;
 	}
 
-	// RENDER THE TILE TEXTURE
+    // UPLOAD THE SHEET, one upload per stretch of changed rows of tiles
+    if (whole){
+        Image img = (Image){
+            &pixels[0][0],
+            VRAM_INSPECTOR_WIDTH*8, SHEET_ROWS*8,
+            1,
+            PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+        };
+
+        sheet = LoadTextureFromImage(img);
+    }
+
+    else while (changed_rows){
+        int first = __builtin_ctzll(changed_rows);
+        int count = __builtin_ctzll(~(changed_rows >> first));
+        changed_rows &= ~((((uint64_t)1 << count) - 1) << first);
+
+        UpdateTextureRec(
+            sheet, 
+            (Rectangle){0, first*8, VRAM_INSPECTOR_WIDTH*8, count*8}, 
+            &pixels[first*8][0]
+        );
+    }
+
+	// RENDER THE SHEET, the full rows of tiles and the last one apart
+    int full_rows = VRAM_TILE_COUNT / VRAM_INSPECTOR_WIDTH;
+    int last_tiles = VRAM_TILE_COUNT % VRAM_INSPECTOR_WIDTH;
 	DrawTexturePro(
-		tiles_textures[tiles_textures_i],
-		(Rectangle){0,0,8,8},
-		(Rectangle){x,y,8*scale, 8*scale},
+		sheet,
+		(Rectangle){0, 0, VRAM_INSPECTOR_WIDTH*8, full_rows*8},
+		(Rectangle){x, y, VRAM_INSPECTOR_WIDTH*8*scale, full_rows*8*scale},
 		(Vector2){0,0},
 		0, WHITE
 	);
-	
-    // ADVANCE OR REVERSE THE TEXTURE COUNTER
-    tiles_textures_i++;
-    if (tiles_textures_i >= VRAM_TILE_COUNT)
-        tiles_textures_i = 0;
 
-}
+    if (last_tiles > 0){
+        DrawTexturePro(
+            sheet,
+            (Rectangle){0, full_rows*8, last_tiles*8, 8},
+            (Rectangle){x, y + full_rows*8*scale, last_tiles*8*scale, 8*scale},
+            (Vector2){0,0},
+            0, WHITE
+        );
+    }
 
-static void __draw_vram_tiles(tile_t *tiles, int x, int y, int line_width, float scale){
-	int x_offset = 0;
-	int y_offset = 0;
-	int tiles_online = 0;
-	int tiles_drawn = 0;
-	for (int i=0; i<VRAM_TILE_COUNT; i++){
-		tile_t *t = &tiles[i];
-		__draw_tile(t, x + x_offset, y + y_offset, scale);
-		// Render selected tile outline
-		if (tiles_drawn == selected_tile){
-			DrawRectangleLines(
-				x+x_offset, 
-				y+y_offset, 
-				8*scale, 
-				8*scale, 
-				PINK
-			);
-		}
-		x_offset += 8*scale;
-		
-		// line break
-		tiles_online++;
-		tiles_drawn++;
-		if (tiles_online >= line_width){
-			x_offset = 0;
-			y_offset += 8*scale;
-			tiles_online = 0;
-		}
-	}
+    // Render selected tile outline
+    DrawRectangleLines(
+        x + (selected_tile % VRAM_INSPECTOR_WIDTH)*8*scale, 
+        y + (selected_tile / VRAM_INSPECTOR_WIDTH)*8*scale, 
+        8*scale, 
+        8*scale, 
+        PINK
+    );
 }
 
-static void __ray_draw(app_state *app){
+static void __ray_draw(app_state *app, const frame_t *f){
+	// Only the frame handed over is read, and the layers when it was
+	// published on this thread
 	BeginDrawing();
 	ClearBackground(BG_COLOR);
 
-	__draw_framebuffers(app);
+	__draw_framebuffers(app, f);
 
 	// DRAW THE TILES INSPECTOR
 	__draw_vram_tiles(
-		tiles_on_vram, 
+		f, 
 		0, 0, 
-		VRAM_INSPECTOR_WIDTH, 
 		3
 	);
 
@@ -200,5 +301,21 @@ static void __ray_draw(app_state *app){
 }
 
 void ray_update(app_state *app){
-    __ray_draw(app);
+    // Draw the newest frame published, the last one again if none is new
+    handoff_take(&app->handoff);
+    if (app->headless.enabled)
+        headless_update(app, &app->frames[app->handoff.front]);
+    else
+        __ray_draw(app, &app->frames[app->handoff.front]);
+}
+
+bool ray_should_close(app_state *app){
+    if (app->headless.enabled)
+        return headless_should_close(app);
+    return WindowShouldClose();
+}
+
+void ray_close(app_state *app){
+    if (!app->headless.enabled)
+        CloseWindow();
 }
\ No newline at end of file
@@ -5,5 +5,7 @@
 
 void ray_init(app_state *app);
 void ray_update(app_state *app);
+bool ray_should_close(app_state *app);
+void ray_close(app_state *app);
 
 #endif
\ No newline at end of file
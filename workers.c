@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "workers.h"
+
+static void *worker_main(void *data){
+	workers_slot_t *slot = data;
+	workers_t *pool = slot->pool;
+	uint32_t job = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;){
+		while (pool->job == job && !pool->quit)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit) break;
+
+		job = pool->job;
+		workers_fn fn = pool->fn;
+		void *arg = pool->arg;
+		pthread_mutex_unlock(&pool->lock);
+
+		fn(arg, slot->band, pool->count);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+int workers_start(workers_t *pool, int count){
+	// The caller runs band 0, count - 1 threads are created for the rest.
+	// With a count of 1 jobs run on the caller alone.
+	memset(pool, 0, sizeof(workers_t));
+	if (count < 1) count = 1;
+	if (count > WORKERS_MAX) count = WORKERS_MAX;
+	pool->count = 1;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (int i=1; i<count; i++){
+		pool->slots[i] = (workers_slot_t){pool, i};
+		if (pthread_create(&pool->threads[i], NULL, worker_main, &pool->slots[i]))
+			break;
+		pool->count++;
+	}
+
+	return pool->count;
+}
+
+void workers_stop(workers_t *pool){
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i=1; i<pool->count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	pool->count = 0;
+}
+
+void workers_run(workers_t *pool, workers_fn fn, void *arg){
+	// Returns once every band is done
+	if (pool->count <= 1){
+		fn(arg, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->pending = pool->count - 1;
+	pool->job++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	fn(arg, 0, pool->count);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,37 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define WORKERS_MAX 8                       // Threads, the caller included
+
+// Runs band of bands, every thread gets a different band
+typedef void (*workers_fn)(void *arg, int band, int bands);
+
+typedef struct workers_slot{
+	struct workers *pool;
+	int band;
+} workers_slot_t;
+
+// Persistent threads that run a job together with the caller
+typedef struct workers{
+	pthread_t threads[WORKERS_MAX];
+	workers_slot_t slots[WORKERS_MAX];
+	int count;                              // Threads, the caller included
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	uint32_t job;                           // Bumped for every job
+	int pending;                            // Threads still running the job
+	bool quit;
+	workers_fn fn;
+	void *arg;
+} workers_t;
+
+int workers_start(workers_t *pool, int count);
+void workers_stop(workers_t *pool);
+void workers_run(workers_t *pool, workers_fn fn, void *arg);
+
+#endif